@@ -31,158 +31,1330 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#if __cplusplus >= 201103L
+# include <functional>
+#endif
+#include <iterator>
+#include <new>
+#include <utility>
 #include <vector>
-#include <typeinfo>
+#if __cplusplus >= 201103L
+# include <atomic>
+# include <mutex>
+# include <thread>
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+# define PICOSTRING_USE_SSE2 1
+# include <emmintrin.h>
+#endif
+#ifndef _WIN32
+# include <cerrno>
+# include <climits>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/types.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
+
+#if __cplusplus >= 201103L
+# define PICOSTRING_THREAD_LOCAL thread_local
+# define PICOSTRING_CONST_LVALUE const &
+#elif defined(__GNUC__)
+# define PICOSTRING_THREAD_LOCAL __thread
+#else
+# define PICOSTRING_THREAD_LOCAL
+#endif
+#ifndef PICOSTRING_CONST_LVALUE
+# define PICOSTRING_CONST_LVALUE const
+#endif
+
+#ifndef PICOSTRING_SMALL_LEAF_SIZE
+# define PICOSTRING_SMALL_LEAF_SIZE 128
+#endif
+#ifndef PICOSTRING_TAIL_LEAF_SIZE
+# define PICOSTRING_TAIL_LEAF_SIZE 4096
+#endif
+// if non-zero, a substr of a string leaf holding more than this many times
+// the characters of the substr copies them instead of referring to the leaf
+#ifndef PICOSTRING_AUTO_COMPACT_RATIO
+# define PICOSTRING_AUTO_COMPACT_RATIO 0
+#endif
+#ifndef PICOSTRING_PARALLEL_FLATTEN_SIZE
+# define PICOSTRING_PARALLEL_FLATTEN_SIZE (1024 * 1024)
+#endif
+
+// allocator policies for the nodes of picostring; each provides
+// allocate(size) and deallocate(ptr, size)
+
+// allocates every node from the general-purpose heap (the default)
+class picostring_heap_allocator {
+public:
+  static void* allocate(size_t size) { return ::operator new(size); }
+  static void deallocate(void* p, size_t) { ::operator delete(p); }
+};
+
+// keeps per-thread free lists for each size class, so that nodes are
+// recycled without going through the heap; memory once taken by the pool is
+// never returned to the heap, but the blocks left on the lists of a thread
+// are handed over to the other threads when it exits (lost before C++11,
+// which lacks a way to run code at thread exit)
+class picostring_pool_allocator {
+  enum { GRANULARITY = 16, NUM_CLASSES = 16, CHUNK_SIZE = 16384 };
+#if __cplusplus >= 201103L
+  // the blocks of threads that have exited, adopted by the next thread to
+  // run out of blocks of the class
+  struct Orphans {
+    std::mutex mutex;
+    void* lists[NUM_CLASSES];
+  };
+  static Orphans& _orphans() {
+    static Orphans orphans;
+    return orphans;
+  }
+  struct Lists {
+    void* lists[NUM_CLASSES];
+    ~Lists() {
+      Orphans& orphans = _orphans();
+      for (size_t cls = 0; cls != NUM_CLASSES; ++cls) {
+	if (lists[cls] == NULL)
+	  continue;
+	void** tail = static_cast<void**>(lists[cls]);
+	while (*tail != NULL)
+	  tail = static_cast<void**>(*tail);
+	std::lock_guard<std::mutex> lock(orphans.mutex);
+	*tail = orphans.lists[cls];
+	orphans.lists[cls] = lists[cls];
+      }
+    }
+  };
+  static void*& _freeList(size_t cls) {
+    static thread_local Lists lists;
+    return lists.lists[cls];
+  }
+  static bool _adopt(size_t cls) {
+    Orphans& orphans = _orphans();
+    std::lock_guard<std::mutex> lock(orphans.mutex);
+    if (orphans.lists[cls] == NULL)
+      return false;
+    _freeList(cls) = orphans.lists[cls];
+    orphans.lists[cls] = NULL;
+    return true;
+  }
+#else
+  static void*& _freeList(size_t cls) {
+    static PICOSTRING_THREAD_LOCAL void* lists[NUM_CLASSES];
+    return lists[cls];
+  }
+  static bool _adopt(size_t) { return false; }
+#endif
+  static void _refill(size_t cls) {
+    const size_t blockSize = (cls + 1) * GRANULARITY;
+    char* chunk = static_cast<char*>(::operator new(CHUNK_SIZE));
+    void*& head = _freeList(cls);
+    for (size_t off = 0; off + blockSize <= CHUNK_SIZE; off += blockSize) {
+      *reinterpret_cast<void**>(chunk + off) = head;
+      head = chunk + off;
+    }
+  }
+public:
+  static void* allocate(size_t size) {
+    const size_t cls = (size - 1) / GRANULARITY;
+    if (cls >= NUM_CLASSES)
+      return ::operator new(size);
+    void*& head = _freeList(cls);
+    if (head == NULL && ! _adopt(cls))
+      _refill(cls);
+    void* p = head;
+    head = *static_cast<void**>(p);
+    return p;
+  }
+  static void deallocate(void* p, size_t size) {
+    const size_t cls = (size - 1) / GRANULARITY;
+    if (cls >= NUM_CLASSES) {
+      ::operator delete(p);
+      return;
+    }
+    void*& head = _freeList(cls);
+    *static_cast<void**>(p) = head;
+    head = p;
+  }
+};
+
+// a region from which nodes are carved while it is the innermost arena alive
+// on the thread; freeing a node is a no-op, and all the memory is released at
+// once when the arena is destroyed, which must happen after every
+// picostring using it has been destroyed
+class picostring_arena {
+  enum { ALIGNMENT = 16, CHUNK_SIZE = 65536 };
+  std::vector<char*> chunks_;
+  char* cur_;
+  size_t left_;
+  picostring_arena* prev_;
+  picostring_arena(const picostring_arena&);
+  picostring_arena& operator=(const picostring_arena&);
+  static picostring_arena*& _current() {
+    static PICOSTRING_THREAD_LOCAL picostring_arena* current;
+    return current;
+  }
+public:
+  picostring_arena() : chunks_(), cur_(NULL), left_(0), prev_(_current()) {
+    _current() = this;
+  }
+  ~picostring_arena() {
+    assert(_current() == this);
+    _current() = prev_;
+    for (size_t i = 0; i != chunks_.size(); ++i)
+      ::operator delete(chunks_[i]);
+  }
+  static picostring_arena* current() { return _current(); }
+  void* allocate(size_t size) {
+    size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (size > left_) {
+      size_t chunkSize = std::max(size, static_cast<size_t>(CHUNK_SIZE));
+      chunks_.push_back(static_cast<char*>(::operator new(chunkSize)));
+      cur_ = chunks_.back();
+      left_ = chunkSize;
+    }
+    void* p = cur_;
+    cur_ += size;
+    left_ -= size;
+    return p;
+  }
+};
+
+// allocates nodes from the current picostring_arena of the thread
+class picostring_arena_allocator {
+public:
+  static void* allocate(size_t size) {
+    assert(picostring_arena::current() != NULL);
+    return picostring_arena::current()->allocate(size);
+  }
+  static void deallocate(void*, size_t) {}
+};
+
+// threading policies for picostring; each provides the reference counter of
+// the nodes and a slot to which results computed on demand (the flattened
+// content, the hash) can be published
+
+// the default; a rope (and any rope sharing nodes with it) must only be
+// accessed from one thread at a time
+struct picostring_single_threaded {
+  enum { CONCURRENT = 0 };
+  typedef size_t refcount_type;
+  template <typename T> struct slot { typedef T type; };
+  static void retain(refcount_type& r) { ++r; }
+  static bool release(refcount_type& r) { return r-- == 0; }
+  static bool unique(const refcount_type& r) { return r == 0; }
+  template <typename T> static T load(const T& slot) { return slot; }
+  // sets the slot unless it is already set; returns the value of the slot
+  template <typename T> static T publish(T& slot, T value) {
+    if (slot == T())
+      slot = value;
+    return slot;
+  }
+};
+
+#if __cplusplus >= 201103L
+
+// ropes may be shared and read concurrently from any number of threads;
+// the handles themselves are never modified by const operations
+struct picostring_multi_threaded {
+  enum { CONCURRENT = 1 };
+  typedef std::atomic<size_t> refcount_type;
+  template <typename T> struct slot { typedef std::atomic<T> type; };
+  static void retain(refcount_type& r) {
+    r.fetch_add(1, std::memory_order_relaxed);
+  }
+  // the last release acquires the writes of all others before destruction
+  static bool release(refcount_type& r) {
+    return r.fetch_sub(1, std::memory_order_acq_rel) == 0;
+  }
+  static bool unique(const refcount_type& r) {
+    return r.load(std::memory_order_acquire) == 0;
+  }
+  template <typename T> static T load(const std::atomic<T>& slot) {
+    return slot.load(std::memory_order_acquire);
+  }
+  template <typename T> static T publish(std::atomic<T>& slot, T value) {
+    T expected = T();
+    if (slot.compare_exchange_strong(expected, value,
+				     std::memory_order_acq_rel,
+				     std::memory_order_acquire))
+      return value;
+    return expected;
+  }
+};
+
+#endif
+
+// instrumentation policies for picostring; each is told of the allocation
+// and destruction of nodes, of the characters copied by flattening (in
+// bytes), and of the steps taken by at() to descend to a leaf
+
+// ignores all events (the default), costing nothing
+struct picostring_no_instrumentation {
+  static void allocated(size_t) {}
+  static void freed(size_t) {}
+  static void flattened(size_t) {}
+  static void descended(size_t) {}
+};
 
-template <typename StringT> class picostring {
+struct picostring_counters {
+  size_t nodes_allocated;
+  size_t nodes_freed;
+  size_t flattens;
+  size_t bytes_flattened;
+  size_t descent_steps;
+};
+
+// counts the events of each thread (of the process, if thread-local storage
+// is not available); the counters may be read and reset at any time
+struct picostring_counting_instrumentation {
+  static picostring_counters& counters() {
+    static PICOSTRING_THREAD_LOCAL picostring_counters c;
+    return c;
+  }
+  static void allocated(size_t) { ++counters().nodes_allocated; }
+  static void freed(size_t) { ++counters().nodes_freed; }
+  static void flattened(size_t bytes) {
+    picostring_counters& c = counters();
+    ++c.flattens;
+    c.bytes_flattened += bytes;
+  }
+  static void descended(size_t steps) { counters().descent_steps += steps; }
+};
+
+template <typename StringT, typename AllocatorT = picostring_heap_allocator,
+	  typename ThreadingT = picostring_single_threaded,
+	  typename InstrumentationT = picostring_no_instrumentation>
+class picostring {
 public:
   typedef typename StringT::value_type char_type;
   typedef typename StringT::size_type size_type;
+  static const size_type npos = static_cast<size_type>(-1);
 private:
   
   class Node;
+  class LeafNode;
   class StringNode;
+  class SliceNode;
+  class ViewNode;
   class LinkNode;
+  template <typename T> class InlineStack;
+  
+  // holds the flattened content of a node memoized by flattened()
+  typedef typename ThreadingT::template slot<const StringNode*>::type FlatSlot;
+  // holds the hash of a node, and whether it has been computed; any value
+  // (0 for runs of NUL characters, for example) may be a hash
+  typedef typename ThreadingT::template slot<size_t>::type HashSlot;
+  typedef typename ThreadingT::template slot<bool>::type HashedSlot;
   
+  // appends resulting in a leaf no longer than this are merged into one leaf
+  enum { SMALL_LEAF_SIZE = PICOSTRING_SMALL_LEAF_SIZE };
+  // in-place appends extend the rightmost leaf up to this size
+  enum { TAIL_LEAF_SIZE = PICOSTRING_TAIL_LEAF_SIZE };
+  enum { AUTO_COMPACT_RATIO = PICOSTRING_AUTO_COMPACT_RATIO };
+  // ropes shorter than this are always flattened by a single thread
+  enum { PARALLEL_FLATTEN_SIZE = PICOSTRING_PARALLEL_FLATTEN_SIZE };
+  
+  // trees deeper than this are never considered balanced; the Fibonacci
+  // series exceeds any 64-bit size well before reaching it
+  enum { MAX_DEPTH = 96 };
+  // how much deeper than balanced a tree may grow before being rebalanced
+  enum { REBALANCE_SLACK = 8 };
+  
+  // the hash of a rope is the polynomial sum of c[i] * HASH_BASE^(n-1-i)
+  // modulo 2^N (where N is the width of size_t); that of a concatenation is
+  // thus derived from the hashes and the sizes of the parts
+  enum { HASH_BASE = 1000003 };
+  
+  static size_t _hashPower(size_type n) {
+    size_t result = 1, base = HASH_BASE;
+    for (; n != 0; n >>= 1) {
+      if ((n & 1) != 0)
+	result *= base;
+      base *= base;
+    }
+    return result;
+  }
+  
+  static size_type _minLen(size_t depth) {
+    struct Table {
+      size_type len[MAX_DEPTH + 2];
+      Table() {
+	const size_type maxLen = static_cast<size_type>(-1);
+	len[0] = 1;
+	len[1] = 2;
+	for (size_t i = 2; i != MAX_DEPTH + 2; ++i)
+	  len[i] = len[i - 1] <= maxLen - len[i - 2]
+	    ? len[i - 1] + len[i - 2] : maxLen;
+      }
+    };
+    static const Table table;
+    return depth <= MAX_DEPTH + 1 ? table.len[depth]
+      : static_cast<size_type>(-1);
+  }
+  
+  // nodes are not polymorphic; the kind of a node is recorded in a tag and
+  // operations are dispatched by switching on it, so that a node only
+  // carries its size, reference counter, tag and depth in addition to its
+  // own fields
   class Node {
-    const size_type size_;
-    mutable size_t refcnt_;
+  public:
+    enum Kind { STRING, SLICE, VIEW, LINK };
+  private:
+    size_type size_;
+    mutable typename ThreadingT::refcount_type refcnt_;
+    const unsigned char kind_;
+    mutable HashedSlot hashed_;
+    const unsigned depth_;
+    mutable HashSlot hash_;
   protected:
     ~Node() {}
   public:
-    Node(size_type size) : size_(size), refcnt_(0) {}
-    const Node* retain() const { refcnt_++; return this; }
-    bool release() const { return refcnt_-- == 0; }
+    Node(Kind kind, size_type size, size_t depth)
+      : size_(size), refcnt_(0), kind_(kind), hashed_(false),
+	depth_(static_cast<unsigned>(depth)), hash_(0) {}
+    static void* operator new(size_t size) {
+      void* p = AllocatorT::allocate(size);
+      InstrumentationT::allocated(size);
+      return p;
+    }
+    static void operator delete(void* p, size_t size) {
+      InstrumentationT::freed(size);
+      AllocatorT::deallocate(p, size);
+    }
+    const Node* retain() const { ThreadingT::retain(refcnt_); return this; }
+    bool release() const { return ThreadingT::release(refcnt_); }
+    bool isUnique() const { return ThreadingT::unique(refcnt_); }
     size_type size() const { return size_; }
-    virtual void destroy() const = 0;
-    virtual const Node* nodeAt(size_type& pos) const = 0;
-    virtual const Node* append(const Node* s) const = 0;
-    virtual const Node* append(const StringT& s) const = 0;
-    virtual const StringNode* flatten() const = 0;
-    virtual char_type* flatten(char_type* out, std::vector<const Node*>& delayed) const = 0;
-    static bool _releaseMayDefer(const Node* node) {
-      if (node->release()) {
-	if (typeid(*node) == typeid(LinkNode))
-	  return true;
+    // only for nodes that are not shared, see picostring::append_inplace
+    void _grow(size_type length) {
+      size_ += length;
+      hashed_ = false;
+      hash_ = 0;
+    }
+    // the hash is computed on first use and cached; the flag is published
+    // after the hash, so that a thread seeing it set also sees the hash
+    size_t hash() const {
+      if (ThreadingT::load(hashed_))
+	return ThreadingT::load(hash_);
+      size_t h;
+      switch (kind_) {
+      case LINK:
+	h = static_cast<const LinkNode*>(this)->_hash();
+	break;
+      default:
+	h = static_cast<const LeafNode*>(this)->_hash();
+	break;
+      }
+      ThreadingT::publish(hash_, h);
+      ThreadingT::publish(hashed_, true);
+      return h;
+    }
+    bool isHashed() const { return ThreadingT::load(hashed_); }
+    Kind kind() const { return static_cast<Kind>(kind_); }
+    size_t depth() const { return depth_; }
+    // a node is balanced if it is at least as long as the shortest tree of
+    // the same depth built by the Fibonacci recurrence (Boehm et al.)
+    bool isBalanced() const { return size_ >= _minLen(depth_); }
+    void destroy() const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->destroy();
+      case SLICE:
+	return static_cast<const SliceNode*>(this)->destroy();
+      case VIEW:
+	return static_cast<const ViewNode*>(this)->destroy();
+      default:
+	return static_cast<const StringNode*>(this)->destroy();
+      }
+    }
+    const Node* substr(size_type pos, size_type length) const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->substr(pos, length);
+      case SLICE:
+	return static_cast<const SliceNode*>(this)->substr(pos, length);
+      case VIEW:
+	return static_cast<const ViewNode*>(this)->substr(pos, length);
+      default:
+	return static_cast<const StringNode*>(this)->substr(pos, length);
+      }
+    }
+    // appends and prepends consume the reference to this node held by the
+    // caller
+    const Node* append(const Node* s) const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->append(s);
+      default:
+	return static_cast<const LeafNode*>(this)->append(s);
+      }
+    }
+    const Node* append(const char_type* s, size_type length) const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->append(s, length);
+      default:
+	return static_cast<const LeafNode*>(this)->append(s, length);
+      }
+    }
+    const Node* prepend(const char_type* s, size_type length) const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->prepend(s, length);
+      default:
+	return static_cast<const LeafNode*>(this)->prepend(s, length);
+      }
+    }
+    const StringNode* flatten() const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->flatten();
+      case SLICE:
+	return static_cast<const SliceNode*>(this)->flatten();
+      case VIEW:
+	return static_cast<const ViewNode*>(this)->flatten();
+      default:
+	return static_cast<const StringNode*>(this)->flatten();
+      }
+    }
+    // returns the content as a single leaf owned by this node, leaving the
+    // tree intact
+    const StringNode* flattened() const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->flattened();
+      case SLICE:
+	return static_cast<const SliceNode*>(this)->flattened();
+      case VIEW:
+	return static_cast<const ViewNode*>(this)->flattened();
+      default:
+	return static_cast<const StringNode*>(this)->flattened();
+      }
+    }
+    // returns the flattened content memoized by this node, if any
+    const StringNode* memoized() const {
+      switch (kind_) {
+      case LINK:
+	return ThreadingT::load(static_cast<const LinkNode*>(this)->_flatSlot());
+      case SLICE:
+	return ThreadingT::load(static_cast<const SliceNode*>(this)->_flatSlot());
+      case VIEW:
+	return ThreadingT::load(static_cast<const ViewNode*>(this)->_flatSlot());
+      default:
+	return NULL;
+      }
+    }
+    char_type* flatten(char_type* out, InlineStack<const Node*>& pending) const {
+      switch (kind_) {
+      case LINK:
+	return static_cast<const LinkNode*>(this)->flatten(out, pending);
+      default:
+	return static_cast<const LeafNode*>(this)->flatten(out, pending);
+      }
+    }
+    // concatenates two nodes (taking ownership of both references), and
+    // rebalances the result if its depth got out of bound; some slack is
+    // given so that the cost of rebalancing is amortized over the appends
+    // in between, and so that the rightmost leaf stays reachable for merging
+    // short appends
+    static const Node* _concat(const Node* left, const Node* right) {
+      const Node* node = new LinkNode(_unmemoize(left), _unmemoize(right));
+      if (node->depth() > REBALANCE_SLACK
+	  && node->size() < _minLen(node->depth() - REBALANCE_SLACK))
+	node = _balance(node);
+      return node;
+    }
+    // consumes the reference to a node about to be linked under a new
+    // parent, returning one to the leaf memoizing its content if there is
+    // one; the tree below is then freed once no other rope refers to it,
+    // instead of being kept alongside the copy
+    static const Node* _unmemoize(const Node* node) {
+      const StringNode* flat = node->memoized();
+      if (flat == NULL)
+	return node;
+      flat->retain();
+      if (node->release())
 	node->destroy();
+      return flat;
+    }
+    static const Node* _balance(const Node* root) {
+      const Node* forest[MAX_DEPTH + 1];
+      std::fill(forest, forest + MAX_DEPTH + 1, static_cast<const Node*>(NULL));
+      _addToForest(root, forest);
+      const Node* result = NULL;
+      for (size_t i = 0; i <= MAX_DEPTH; ++i)
+	if (forest[i] != NULL)
+	  result = result != NULL ? new LinkNode(forest[i], result) : forest[i];
+      if (root->release())
+	root->destroy();
+      return result;
+    }
+    static void _addToForest(const Node* node, const Node** forest) {
+      if (node->isBalanced()) {
+	_addLeafToForest(node->retain(), forest);
+      } else {
+	const LinkNode* link = static_cast<const LinkNode*>(node);
+	_addToForest(link->left(), forest);
+	_addToForest(link->right(), forest);
+      }
+    }
+    static void _addLeafToForest(const Node* node, const Node** forest) {
+      const Node* tooTiny = NULL;
+      size_t i;
+      for (i = 0; node->size() >= _minLen(i + 1); ++i) {
+	if (forest[i] != NULL) {
+	  tooTiny = tooTiny != NULL ? new LinkNode(forest[i], tooTiny) : forest[i];
+	  forest[i] = NULL;
+	}
+      }
+      if (tooTiny != NULL)
+	node = new LinkNode(tooTiny, node);
+      for (; ; ++i) {
+	if (forest[i] != NULL) {
+	  node = new LinkNode(forest[i], node);
+	  forest[i] = NULL;
+	}
+	if (i == MAX_DEPTH || node->size() < _minLen(i + 1)) {
+	  forest[i] = node;
+	  break;
+	}
       }
-      return false;
     }
   };
   
-  class StringNode : public Node {
-    const StringT s_;
-    const size_type offset_;
+  // a leaf is a run of characters stored contiguously, either by itself, by
+  // the leaf it is a slice of, or outside of the rope; the pointer to the
+  // characters is kept in the common part so that reading them does not
+  // depend on the kind
+  class LeafNode : public Node {
+  protected:
+    const char_type* data_;
+    ~LeafNode() {}
+  public:
+    LeafNode(typename Node::Kind kind, const char_type* data, size_type length)
+      : Node(kind, length, 0), data_(data) {}
+    const char_type* data() const { return data_; }
+    char_type at(size_type pos) const { return data_[pos]; }
+    size_t _hash() const {
+      size_t h = 0;
+      for (size_type i = 0; i != this->size(); ++i)
+	h = h * HASH_BASE
+	  + static_cast<size_t>(StringT::traits_type::to_int_type(data_[i]));
+      return h;
+    }
+    // short runs of characters appended to a short leaf are copied together
+    // into a new leaf instead of being linked
+    const Node* append(const Node* s) const {
+      if (s->depth() == 0 && this->size() + s->size() <= SMALL_LEAF_SIZE)
+	return append(static_cast<const LeafNode*>(s)->data(), s->size());
+      return Node::_concat(this, s->retain());
+    }
+    const Node* append(const char_type* s, size_type length) const {
+      if (this->size() + length <= SMALL_LEAF_SIZE) {
+	const Node* merged = new StringNode(data_, this->size(), s, length);
+	if (this->release())
+	  this->destroy();
+	return merged;
+      }
+      return Node::_concat(this, new StringNode(s, length));
+    }
+    const Node* prepend(const char_type* s, size_type length) const {
+      if (this->size() + length <= SMALL_LEAF_SIZE) {
+	const Node* merged = new StringNode(s, length, data_, this->size());
+	if (this->release())
+	  this->destroy();
+	return merged;
+      }
+      return Node::_concat(new StringNode(s, length), this);
+    }
+    char_type* flatten(char_type* out, InlineStack<const Node*>&) const {
+      out = std::copy(data_, data_ + this->size(), out);
+      if (this->release())
+	this->destroy();
+      return out;
+    }
+    // windows longer than a short leaf refer to the characters of the
+    // original leaf instead of copying them
+    static const Node* _slice(const LeafNode* base, const char_type* data,
+			      size_type length) {
+      if (length <= SMALL_LEAF_SIZE
+	  || (AUTO_COMPACT_RATIO != 0 && base->kind() == Node::STRING
+	      && static_cast<const StringNode*>(base)->capacity()
+		 / AUTO_COMPACT_RATIO > length))
+	return new StringNode(data, length);
+      return new SliceNode(static_cast<const LeafNode*>(base->retain()),
+			   data, length);
+    }
+  };
+  
+  class StringNode : public LeafNode {
+    StringT s_;
     ~StringNode() {}
   public:
-    StringNode(const StringT& s, size_type offset, size_type length)
-      : Node(length), s_(s), offset_(offset) {}
+    explicit StringNode(const StringT& s)
+      : LeafNode(Node::STRING, NULL, s.size()), s_(s) {
+      this->data_ = s_.data();
+    }
     StringNode(const char_type* s, size_type length)
-      : Node(length), s_(s, s + length), offset_(0) {}
+      : LeafNode(Node::STRING, NULL, length), s_(s, s + length) {
+      this->data_ = s_.data();
+    }
+    // copies the content of a tree
+    explicit StringNode(const Node* src)
+      : LeafNode(Node::STRING, NULL, src->size()),
+	s_(src->size(), char_type()) {
+      char_type* dst = &s_[0];
+      LeafCursor cursor(src);
+      while (const LeafNode* leaf = cursor.next())
+	dst = std::copy(leaf->data(), leaf->data() + leaf->size(), dst);
+      this->data_ = s_.data();
+    }
+    // to be filled through _buffer()
+    explicit StringNode(size_type length)
+      : LeafNode(Node::STRING, NULL, length), s_(length, char_type()) {
+      this->data_ = s_.data();
+    }
+    StringNode(const char_type* s1, size_type length1, const char_type* s2,
+	       size_type length2)
+      : LeafNode(Node::STRING, NULL, length1 + length2),
+	s_(_join(s1, length1, s2, length2)) {
+      this->data_ = s_.data();
+    }
     const StringT& str() const { return s_; }
-    virtual void destroy() const {
+    size_type capacity() const { return s_.capacity(); }
+    char_type* _buffer() { return &s_[0]; }
+    bool isExtensible(size_type length) const {
+      return this->size() + length <= TAIL_LEAF_SIZE;
+    }
+    void _extend(const char_type* s, size_type length) {
+      s_.append(s, length);
+      this->data_ = s_.data();
+      this->_grow(length);
+    }
+    void destroy() const {
       delete const_cast<StringNode*>(this);
     }
-    virtual const Node* nodeAt(size_type&) const {
-      return NULL;
+    const Node* substr(size_type pos, size_type length) const {
+      if (pos == 0 && length == this->size())
+	return this->retain();
+      return LeafNode::_slice(this, this->data_ + pos, length);
     }
-    virtual const Node* append(const Node* s) const {
-      return new LinkNode(this->retain(), s->retain());
+    static StringT _join(const char_type* s1, size_type length1,
+			 const char_type* s2, size_type length2) {
+      StringT s;
+      s.reserve(length1 + length2);
+      s.append(s1, length1);
+      s.append(s2, length2);
+      return s;
     }
-    virtual const Node* append(const StringT& s) const {
-      return new LinkNode(this->retain(), new StringNode(s, 0, s.size()));
+    const StringNode* flatten() const { return this; }
+    const StringNode* flattened() const { return this; }
+  };
+  
+  // refers to part of the characters of a string or a view leaf, retaining
+  // the leaf
+  class SliceNode : public LeafNode {
+    const LeafNode* base_;
+    mutable FlatSlot flat_;
+    ~SliceNode() {
+      _forget(flat_);
+      if (base_->release())
+	base_->destroy();
     }
-    virtual const StringNode* flatten() const {
-      if (offset_ == 0 && s_.size() == this->size())
-	return this;
-      StringNode* newNode = new StringNode(s_.substr(offset_, this->size()),
-					   0, this->size());
-      if (this->release())
-	delete this;
-      return newNode;
+  public:
+    // takes over the reference to base
+    SliceNode(const LeafNode* base, const char_type* data, size_type length)
+      : LeafNode(Node::SLICE, data, length), base_(base), flat_(NULL) {}
+    const LeafNode* base() const { return base_; }
+    FlatSlot& _flatSlot() const { return flat_; }
+    void destroy() const {
+      delete const_cast<SliceNode*>(this);
     }
-    virtual char_type* flatten(char_type* out, std::vector<const Node*>&) const {
-      std::copy(s_.begin() + offset_, s_.begin() + offset_ + this->size(), out);
-      out += this->size();
-      if (this->release())
-	delete this;
-      return out;
+    const Node* substr(size_type pos, size_type length) const {
+      if (pos == 0 && length == this->size())
+	return this->retain();
+      return LeafNode::_slice(base_, this->data_ + pos, length);
+    }
+    const StringNode* flatten() const {
+      if (! this->isUnique() || ThreadingT::load(flat_) != NULL)
+	return _flattenShared(flat_, this);
+      const StringNode* flat = new StringNode(this->data_, this->size());
+      InstrumentationT::flattened(this->size() * sizeof(char_type));
+      this->destroy();
+      return flat;
+    }
+    const StringNode* flattened() const {
+      return _memoize(flat_, this);
+    }
+  };
+  
+  // refers to characters not owned by the rope; the owner is notified
+  // through the callback once the last leaf referring to them is gone
+  class ViewNode : public LeafNode {
+    void (*release_)(void*);
+    void* arg_;
+    mutable FlatSlot flat_;
+    ~ViewNode() {
+      _forget(flat_);
+      if (release_ != NULL)
+	release_(arg_);
+    }
+  public:
+    ViewNode(const char_type* data, size_type length,
+	     void (*releaseFn)(void*), void* arg)
+      : LeafNode(Node::VIEW, data, length), release_(releaseFn), arg_(arg),
+	flat_(NULL) {}
+    FlatSlot& _flatSlot() const { return flat_; }
+    void destroy() const {
+      delete const_cast<ViewNode*>(this);
+    }
+    const Node* substr(size_type pos, size_type length) const {
+      if (pos == 0 && length == this->size())
+	return this->retain();
+      return LeafNode::_slice(this, this->data_ + pos, length);
+    }
+    const StringNode* flatten() const {
+      if (! this->isUnique() || ThreadingT::load(flat_) != NULL)
+	return _flattenShared(flat_, this);
+      const StringNode* flat = new StringNode(this->data_, this->size());
+      InstrumentationT::flattened(this->size() * sizeof(char_type));
+      this->destroy();
+      return flat;
+    }
+    const StringNode* flattened() const {
+      return _memoize(flat_, this);
     }
   };
   
   class LinkNode : public Node {
     const Node* left_;
     const Node* right_;
-    ~LinkNode() {}
+    mutable FlatSlot flat_;
+    ~LinkNode() { _forget(flat_); }
   public:
     LinkNode(const Node* left, const Node* right)
-      : Node(left->size() + right->size()), left_(left), right_(right) {}
-    virtual void destroy() const {
-      std::vector<const LinkNode*> deferred;
-      deferred.push_back(this);
-      do {
-	const LinkNode* node = deferred.back();
-	if (Node::_releaseMayDefer(node->left_)) {
-	  deferred.back() = static_cast<const LinkNode*>(node->left_);
-	  if (Node::_releaseMayDefer(node->right_))
-	    deferred.push_back(static_cast<const LinkNode*>(node->right_));
-	} else if (Node::_releaseMayDefer(node->right_))
-	  deferred.back() = static_cast<const LinkNode*>(node->right_);
-	else
-	  deferred.pop_back();
-	delete const_cast<LinkNode*>(node);
-      } while (! deferred.empty());
-    }
-    virtual const Node* nodeAt(size_type& pos) const {
-      if (pos < left_->size()) {
-	return left_;
-      } else {
-	pos -= left_->size();
-	return right_;
+      : Node(Node::LINK, left->size() + right->size(),
+	     std::max(left->depth(), right->depth()) + 1),
+	left_(left), right_(right), flat_(NULL) {}
+    const Node* left() const { return left_; }
+    const Node* right() const { return right_; }
+    size_t _hash() const {
+      return left_->hash() * _hashPower(right_->size()) + right_->hash();
+    }
+    // called for each node on the path to a leaf being extended
+    void _grow(size_type length) {
+      _forget(flat_);
+      Node::_grow(length);
+    }
+    // destroys the subtrees no longer being referred to without recursion
+    // or allocation; the left_ field of a node whose left subtree is being
+    // destroyed is reused as the link to its parent
+    void destroy() const {
+      LinkNode* node = const_cast<LinkNode*>(this);
+      LinkNode* parent = NULL;
+      for (;;) {
+	const Node* left = node->left_;
+	if (left->release()) {
+	  if (left->depth() != 0) {
+	    node->left_ = parent;
+	    parent = node;
+	    node = static_cast<LinkNode*>(const_cast<Node*>(left));
+	    continue;
+	  }
+	  left->destroy();
+	}
+	// the left subtree is gone; destroy the node and continue with its
+	// right subtree, or that of the nearest ancestor still pending
+	for (;;) {
+	  const Node* right = node->right_;
+	  delete node;
+	  if (right->release()) {
+	    if (right->depth() != 0) {
+	      node = static_cast<LinkNode*>(const_cast<Node*>(right));
+	      break;
+	    }
+	    right->destroy();
+	  }
+	  if (parent == NULL)
+	    return;
+	  node = parent;
+	  parent = static_cast<LinkNode*>(const_cast<Node*>(node->left_));
+	}
+      }
+    }
+    const Node* substr(size_type pos, size_type length) const {
+      const size_type leftSize = left_->size();
+      if (pos == 0 && length == this->size())
+	return this->retain();
+      if (pos + length <= leftSize)
+	return left_->substr(pos, length);
+      if (pos >= leftSize)
+	return right_->substr(pos - leftSize, length);
+      return Node::_concat(left_->substr(pos, leftSize - pos),
+			   right_->substr(0, pos + length - leftSize));
+    }
+    const Node* append(const Node* s) const {
+      if (s->depth() == 0 && right_->depth() == 0
+	  && right_->size() + s->size() <= SMALL_LEAF_SIZE) {
+	const Node* left, * right;
+	_detach(left, right);
+	return Node::_concat(left, right->append(s));
       }
+      return Node::_concat(this, s->retain());
     }
-    virtual const Node* append(const Node* s) const {
-      return new LinkNode(this->retain(), s->retain());
+    const Node* append(const char_type* s, size_type length) const {
+      if (right_->depth() == 0 && right_->size() + length <= SMALL_LEAF_SIZE) {
+	const Node* left, * right;
+	_detach(left, right);
+	return Node::_concat(left, right->append(s, length));
+      }
+      return Node::_concat(this, new StringNode(s, length));
+    }
+    const Node* prepend(const char_type* s, size_type length) const {
+      if (left_->depth() == 0 && left_->size() + length <= SMALL_LEAF_SIZE) {
+	const Node* left, * right;
+	_detach(left, right);
+	return Node::_concat(left->prepend(s, length), right);
+      }
+      return Node::_concat(new StringNode(s, length), this);
     }
-    virtual const Node* append(const StringT& s) const {
-      return new LinkNode(this->retain(), new StringNode(s, 0, s.size()));
+    // consumes the reference to this node, returning references to its
+    // children; if the reference was the only one, they are taken over
+    // without touching their counters
+    void _detach(const Node*& left, const Node*& right) const {
+      left = left_;
+      right = right_;
+      if (this->isUnique()) {
+	delete this;
+      } else {
+	left->retain();
+	right->retain();
+	if (this->release())
+	  this->destroy();
+      }
     }
-    virtual const StringNode* flatten() const {
-      StringT s(this->size(), char_type());
-      std::vector<const Node*> pending;
-      char_type* dst = flatten(&s[0], pending);
+    // consumes the reference to this node; the nodes no longer being
+    // referred to are destroyed as their content is copied
+    const StringNode* flatten() const {
+      if (! this->isUnique() || ThreadingT::load(flat_) != NULL)
+	return _flattenShared(flat_, this);
+      StringNode* flat = new StringNode(this->size());
+      InstrumentationT::flattened(this->size() * sizeof(char_type));
+      InlineStack<const Node*> pending;
+      char_type* dst = flatten(flat->_buffer(), pending);
       do {
-	const Node* top = pending.back();
-	pending.pop_back();
+	const Node* top = pending.top();
+	pending.pop();
 	dst = top->flatten(dst, pending);
       } while (! pending.empty());
-      return new StringNode(s, 0, this->size());
+      return flat;
     }
-    virtual char_type* flatten(char_type* out, std::vector<const Node*>& delayed) const {
-      delayed.push_back(right_);
-      delayed.push_back(left_);
-      if (this->release())
+    const StringNode* flattened() const {
+      return _memoize(flat_, this);
+    }
+    FlatSlot& _flatSlot() const { return flat_; }
+    char_type* flatten(char_type* out, InlineStack<const Node*>& pending) const {
+      if (this->isUnique()) {
+	pending.push(right_);
+	pending.push(left_);
 	delete this;
-      else {
-	right_->retain();
-	left_->retain();
+	return out;
       }
+      // shared by others that keep it alive; copy without touching the
+      // counters of the subtree
+      LeafCursor cursor(this);
+      while (const LeafNode* leaf = cursor.next())
+	out = std::copy(leaf->data(), leaf->data() + leaf->size(), out);
+      if (this->release())
+	this->destroy();
       return out;
     }
   };
   
+  // returns the content of src flattened into a leaf held by slot, creating
+  // the leaf unless another thread has already done so
+  static const StringNode* _memoize(FlatSlot& slot, const Node* src) {
+    if (const StringNode* flat = ThreadingT::load(slot))
+      return flat;
+    InstrumentationT::flattened(src->size() * sizeof(char_type));
+    return _publish(slot, new StringNode(src));
+  }
+  // sets slot to flat (taking over the reference) unless it is already set;
+  // returns the leaf held by the slot
+  static const StringNode* _publish(FlatSlot& slot, const StringNode* flat) {
+    const StringNode* published = ThreadingT::publish(slot, flat);
+    if (published != flat)
+      flat->destroy();
+    return published;
+  }
+  // flattens a node shared with others (or flattened by them), consuming
+  // the reference to it; the result is memoized in slot so that those
+  // sharing the node do not flatten it again
+  static const StringNode* _flattenShared(FlatSlot& slot, const Node* src) {
+    const StringNode* flat
+      = static_cast<const StringNode*>(_memoize(slot, src)->retain());
+    if (src->release())
+      src->destroy();
+    return flat;
+  }
+  // drops the memoized content, if any
+  static void _forget(FlatSlot& slot) {
+    if (const StringNode* flat = ThreadingT::load(slot)) {
+      slot = NULL;
+      if (flat->release())
+	flat->destroy();
+    }
+  }
+  
+  // stack used for traversing a tree; does not allocate unless the tree is
+  // unusually deep
+  template <typename T> class InlineStack {
+    enum { INLINE_SIZE = 48 };
+    T inline_[INLINE_SIZE];
+    std::vector<T> overflow_;
+    size_t size_;
+  public:
+    InlineStack() : size_(0) {}
+    bool empty() const { return size_ == 0; }
+    const T& top() const {
+      return size_ <= INLINE_SIZE ? inline_[size_ - 1] : overflow_.back();
+    }
+    void push(const T& node) {
+      if (size_ < INLINE_SIZE)
+	inline_[size_] = node;
+      else
+	overflow_.push_back(node);
+      ++size_;
+    }
+    void pop() {
+      if (size_ > INLINE_SIZE)
+	overflow_.pop_back();
+      --size_;
+    }
+  };
+  
+  // visits the leaves of a tree from left to right
+  class LeafCursor {
+    InlineStack<const Node*> pending_;
+  public:
+    explicit LeafCursor(const Node* root) {
+      if (root != NULL)
+	pending_.push(root);
+    }
+    // returns the root of the subtree to be visited next, or NULL if none
+    const Node* peek() const {
+      return pending_.empty() ? NULL : pending_.top();
+    }
+    void skip() { pending_.pop(); }
+    const LeafNode* next() {
+      if (pending_.empty())
+	return NULL;
+      const Node* node = pending_.top();
+      pending_.pop();
+      while (node->depth() != 0) {
+	const LinkNode* link = static_cast<const LinkNode*>(node);
+	pending_.push(link->right());
+	node = link->left();
+      }
+      return static_cast<const LeafNode*>(node);
+    }
+  };
+  
   const Node* s_;
   
   explicit picostring(const Node* s) : s_(s) {}
 public:
+  
+  // forward iterator over the chunks (leaves) of the rope, each given as a
+  // pair of pointer and length
+  class chunk_iterator {
+    LeafCursor cursor_;
+    std::pair<const char_type*, size_type> chunk_;
+    size_type pos_;
+    friend class picostring;
+    chunk_iterator(const Node* root, size_type pos)
+      : cursor_(pos == 0 ? root : NULL), chunk_(), pos_(pos) {
+      _load();
+    }
+    void _load() {
+      if (const LeafNode* leaf = cursor_.next())
+	chunk_ = std::make_pair(leaf->data(), leaf->size());
+      else
+	chunk_ = std::make_pair(static_cast<const char_type*>(NULL), size_type(0));
+    }
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef std::pair<const char_type*, size_type> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+    chunk_iterator() : cursor_(NULL), chunk_(), pos_(0) {}
+    reference operator*() const { return chunk_; }
+    pointer operator->() const { return &chunk_; }
+    chunk_iterator& operator++() {
+      pos_ += chunk_.second;
+      _load();
+      return *this;
+    }
+    chunk_iterator operator++(int) {
+      chunk_iterator prev(*this);
+      ++*this;
+      return prev;
+    }
+    // position of the chunk within the rope
+    size_type position() const { return pos_; }
+    friend bool operator==(const chunk_iterator& x, const chunk_iterator& y) {
+      return x.pos_ == y.pos_;
+    }
+    friend bool operator!=(const chunk_iterator& x, const chunk_iterator& y) {
+      return x.pos_ != y.pos_;
+    }
+  };
+  
+  // bidirectional iterator over the characters; keeps the path to the
+  // current leaf so that moving to an adjacent leaf is amortized O(1); the
+  // end of the rope is a sentinel holding no leaf, compared by position
+  // alone, so that end() costs O(1)
+  class const_iterator {
+    struct Step {
+      const LinkNode* node;
+      size_type start;
+    };
+    const Node* root_;
+    InlineStack<Step> path_;
+    const LeafNode* leaf_;
+    size_type leafStart_;
+    size_type offset_;
+    friend class picostring;
+    const_iterator(const Node* root, size_type pos)
+      : root_(root), leaf_(NULL), leafStart_(0), offset_(0) {
+      if (root_ == NULL)
+	return;
+      if (pos < root_->size())
+	_seek(pos);
+      else
+	leafStart_ = root_->size();
+    }
+    void _seek(size_type pos) {
+      const Node* node = root_;
+      size_type start = 0;
+      while (! path_.empty()) {
+	Step step = path_.top();
+	path_.pop();
+	if (step.start <= pos && pos < step.start + step.node->size()) {
+	  node = step.node;
+	  start = step.start;
+	  break;
+	}
+      }
+      while (node->depth() != 0) {
+	const LinkNode* link = static_cast<const LinkNode*>(node);
+	Step step = { link, start };
+	path_.push(step);
+	if (pos < start + link->left()->size()) {
+	  node = link->left();
+	} else {
+	  start += link->left()->size();
+	  node = link->right();
+	}
+      }
+      leaf_ = static_cast<const LeafNode*>(node);
+      leafStart_ = start;
+      offset_ = pos - start;
+    }
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef char_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const char_type* pointer;
+    typedef const char_type& reference;
+    const_iterator() : root_(NULL), leaf_(NULL), leafStart_(0), offset_(0) {}
+    reference operator*() const { return leaf_->data()[offset_]; }
+    pointer operator->() const { return leaf_->data() + offset_; }
+    const_iterator& operator++() {
+      if (++offset_ == leaf_->size() && leafStart_ + offset_ != root_->size())
+	_seek(leafStart_ + offset_);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator prev(*this);
+      ++*this;
+      return prev;
+    }
+    const_iterator& operator--() {
+      // also descends to the last leaf when leaving the end sentinel
+      if (offset_ == 0)
+	_seek(leafStart_ - 1);
+      else
+	--offset_;
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator prev(*this);
+      --*this;
+      return prev;
+    }
+    // position of the iterator within the rope
+    size_type position() const { return leafStart_ + offset_; }
+    friend bool operator==(const const_iterator& x, const const_iterator& y) {
+      return x.position() == y.position();
+    }
+    friend bool operator!=(const const_iterator& x, const const_iterator& y) {
+      return x.position() != y.position();
+    }
+  };
+  typedef const_iterator iterator;
+  
+  // accumulates pieces to be concatenated, and builds a balanced tree of
+  // them at once; short runs of characters are gathered into leaves as they
+  // are appended
+  class builder {
+    std::vector<const Node*> nodes_;
+    StringNode* tail_;
+    size_type size_;
+    builder(const builder&);
+    builder& operator=(const builder&);
+  public:
+    builder() : nodes_(), tail_(NULL), size_(0) {}
+    ~builder() {
+      clear();
+    }
+    // reserves room for the given number of pieces
+    void reserve(size_t numPieces) { nodes_.reserve(numPieces); }
+    size_type size() const { return size_; }
+    builder& append(const picostring& s) {
+      if (s.s_ == NULL)
+	return *this;
+      if (s.s_->depth() == 0 && s.size() <= SMALL_LEAF_SIZE)
+	return append(static_cast<const LeafNode*>(s.s_)->data(), s.size());
+      _flushTail();
+      nodes_.push_back(s.s_->retain());
+      size_ += s.size();
+      return *this;
+    }
+    builder& append(const StringT& s) {
+      return append(s.data(), s.size());
+    }
+    builder& append(const char_type* s, size_type length) {
+      if (length == 0)
+	return *this;
+      if (tail_ != NULL && tail_->isExtensible(length)) {
+	tail_->_extend(s, length);
+      } else {
+	_flushTail();
+	tail_ = new StringNode(s, length);
+      }
+      size_ += length;
+      return *this;
+    }
+    // returns the concatenation of the pieces, leaving the builder empty
+    picostring build() {
+      _flushTail();
+      const Node* root = NULL;
+      if (nodes_.size() > 1 && size_ <= TAIL_LEAF_SIZE) {
+	StringNode* flat = new StringNode(size_);
+	char_type* dst = flat->_buffer();
+	for (size_t i = 0; i != nodes_.size(); ++i) {
+	  LeafCursor cursor(nodes_[i]);
+	  while (const LeafNode* leaf = cursor.next())
+	    dst = std::copy(leaf->data(), leaf->data() + leaf->size(), dst);
+	}
+	clear();
+	root = flat;
+      } else if (! nodes_.empty()) {
+	root = _build(0, nodes_.size());
+	nodes_.clear();
+	size_ = 0;
+      }
+      return picostring(root);
+    }
+    void clear() {
+      for (size_t i = 0; i != nodes_.size(); ++i)
+	if (nodes_[i]->release())
+	  nodes_[i]->destroy();
+      nodes_.clear();
+      if (tail_ != NULL)
+	tail_->destroy();
+      tail_ = NULL;
+      size_ = 0;
+    }
+  private:
+    void _flushTail() {
+      if (tail_ != NULL) {
+	nodes_.push_back(tail_);
+	tail_ = NULL;
+      }
+    }
+    // links the nodes in [first, last) into a tree balanced by count,
+    // taking over their references
+    const Node* _build(size_t first, size_t last) const {
+      if (last - first == 1)
+	return nodes_[first];
+      const size_t mid = first + (last - first) / 2;
+      return Node::_concat(_build(first, mid), _build(mid, last));
+    }
+  };
+  
+  // shape of a tree as reported by stats(); nodes appearing more than once
+  // in the tree are counted each time
+  struct stats_type {
+    size_t depth;
+    size_t num_links;
+    size_t num_strings;
+    size_t num_slices;
+    size_t num_views;
+    // nodes referred to from elsewhere as well
+    size_t num_shared;
+    // nodes holding their flattened content memoized by str()
+    size_t num_memoized;
+    // characters kept alive by the leaves (including the unused capacity of
+    // the strings and the parts of the leaves not covered by their slices)
+    // and by the memoized copies; compare with size() to see the slack
+    size_t storage;
+    size_type min_leaf;
+    size_type max_leaf;
+    double mean_leaf;
+  };
+  
   picostring() : s_(NULL) {}
-  picostring(const picostring& s) : s_(s.s_->retain()) {}
+  picostring(const picostring& s) : s_(s.s_ != NULL ? s.s_->retain() : NULL) {}
+#if __cplusplus >= 201103L
+  picostring(picostring&& s) noexcept : s_(s.s_) { s.s_ = NULL; }
+#endif
   picostring(const StringT& s) : s_(NULL) {
-    if (! s.empty()) s_ = new StringNode(s, 0, s.size());
+    if (! s.empty()) s_ = new StringNode(s);
   }
   picostring(const char_type* s, size_type length) : s_(NULL) {
     if (length != 0) s_ = new StringNode(s, length);
   }
+  // refers to the characters at s without copying them; the caller keeps
+  // them alive until release (if not NULL) is called with arg, which happens
+  // once no rope refers to them
+  static picostring view(const char_type* s, size_type length,
+			 void (*release)(void*), void* arg) {
+    if (length == 0) {
+      if (release != NULL)
+	release(arg);
+      return picostring();
+    }
+    return picostring(new ViewNode(s, length, release, arg));
+  }
+  static picostring view(const char_type* s, size_type length) {
+    return view(s, length, NULL, NULL);
+  }
+  // keeps a copy of owner (e.g. a shared pointer to the buffer) for as long
+  // as the characters are referred to
+  template <typename OwnerT>
+  static picostring view(const char_type* s, size_type length,
+			 const OwnerT& owner) {
+    return view(s, length, &_destroyOwner<OwnerT>, new OwnerT(owner));
+  }
   picostring& operator=(const picostring& s) {
     if (this != &s) {
       if (s_ != NULL && s_->release())
@@ -191,56 +1363,341 @@ public:
     }
     return *this;
   }
+#if __cplusplus >= 201103L
+  picostring& operator=(picostring&& s) noexcept {
+    swap(s);
+    return *this;
+  }
+#endif
   picostring& operator=(const StringT& s) {
     if (s_ != NULL && s_->release())
       s_->destroy();
-    s_ = new StringNode(s, 0, s.size());
+    s_ = ! s.empty() ? new StringNode(s) : NULL;
     return *this;
   }
+  void swap(picostring& s) { std::swap(s_, s.s_); }
+  friend void swap(picostring& x, picostring& y) { x.swap(y); }
   ~picostring() {
     if (s_ != NULL && s_->release())
       s_->destroy();
   }
   bool empty() const { return s_ == NULL; }
+  // rebuilds the tree so that it keeps alive little more than its content;
+  // slices of string leaves more than twice as large are copied out, and
+  // runs of short leaves are merged, as with builder; subtrees shared with
+  // other ropes (the whole tree, if the root is shared) are kept as they
+  // are, since copying them would only add to what they keep alive, and so
+  // are slices of views, which are never copied into the heap
+  void compact() {
+    if (s_ == NULL || ! s_->isUnique()
+	|| (s_->depth() == 0 && ! _isWasteful(s_)))
+      return;
+    builder b;
+    InlineStack<const Node*> pending;
+    pending.push(s_);
+    do {
+      const Node* node = pending.top();
+      pending.pop();
+      if (node->depth() != 0 && node->isUnique()) {
+	const LinkNode* link = static_cast<const LinkNode*>(node);
+	pending.push(link->right());
+	pending.push(link->left());
+      } else if (node->isUnique() && _isWasteful(node)) {
+	b.append(static_cast<const LeafNode*>(node)->data(), node->size());
+      } else {
+	b.append(picostring(node->retain()));
+      }
+    } while (! pending.empty());
+    *this = b.build();
+  }
+  // walks the whole tree to describe its shape
+  stats_type stats() const {
+    stats_type st = stats_type();
+    if (s_ == NULL)
+      return st;
+    st.depth = s_->depth();
+    st.min_leaf = static_cast<size_type>(-1);
+    size_t numLeaves = 0;
+    InlineStack<const Node*> pending;
+    pending.push(s_);
+    do {
+      const Node* node = pending.top();
+      pending.pop();
+      if (! node->isUnique())
+	++st.num_shared;
+      if (const StringNode* flat = node->memoized()) {
+	++st.num_memoized;
+	st.storage += flat->capacity();
+      }
+      if (node->depth() != 0) {
+	++st.num_links;
+	const LinkNode* link = static_cast<const LinkNode*>(node);
+	pending.push(link->right());
+	pending.push(link->left());
+	continue;
+      }
+      switch (node->kind()) {
+      case Node::SLICE:
+	++st.num_slices;
+	st.storage += _storage(static_cast<const SliceNode*>(node)->base());
+	break;
+      case Node::VIEW:
+	++st.num_views;
+	st.storage += node->size();
+	break;
+      default:
+	++st.num_strings;
+	st.storage += _storage(static_cast<const LeafNode*>(node));
+	break;
+      }
+      ++numLeaves;
+      st.min_leaf = std::min(st.min_leaf, node->size());
+      st.max_leaf = std::max(st.max_leaf, node->size());
+    } while (! pending.empty());
+    st.mean_leaf = static_cast<double>(size()) / numLeaves;
+    return st;
+  }
   size_type size() const { return s_ != NULL ? s_->size() : 0; }
   char_type at(size_type pos) const {
     assert(s_ != NULL);
     assert(pos < s_->size());
     const Node* node = s_;
-    while (const Node* n = node->nodeAt(pos))
-      node = n;
-    return static_cast<const StringNode*>(node)->str()[pos];
+    size_t steps = 0;
+    for (; node->depth() != 0; ++steps) {
+      const LinkNode* link = static_cast<const LinkNode*>(node);
+      if (pos < link->left()->size()) {
+	node = link->left();
+      } else {
+	pos -= link->left()->size();
+	node = link->right();
+      }
+    }
+    InstrumentationT::descended(steps);
+    return static_cast<const LeafNode*>(node)->at(pos);
   }
   picostring substr(size_type pos, size_type length) const {
-    assert(pos + length <= s_->size());
+    assert(pos + length <= size());
     if (length == 0)
       return picostring();
-    assert(s_ != NULL);
-    return picostring(new StringNode(_flatten()->str(), pos, length));
+    return picostring(s_->substr(pos, length));
+  }
+  // edits split the tree at the given positions and link the pieces back
+  // together, sharing all the subtrees in between
+  picostring insert(size_type pos, const picostring& s) const {
+    return replace(pos, 0, s);
+  }
+  picostring insert(size_type pos, const StringT& s) const {
+    return replace(pos, 0, picostring(s));
+  }
+  picostring insert(size_type pos, const char_type* s, size_type length) const {
+    return replace(pos, 0, picostring(s, length));
+  }
+  picostring erase(size_type pos, size_type length) const {
+    return replace(pos, length, picostring());
   }
-  picostring append(const picostring& s) const {
+  picostring replace(size_type pos, size_type length, const picostring& s) const {
+    assert(pos + length <= size());
+    return substr(0, pos).append(s)
+      .append(substr(pos + length, size() - pos - length));
+  }
+  picostring replace(size_type pos, size_type length, const StringT& s) const {
+    return replace(pos, length, picostring(s));
+  }
+  picostring replace(size_type pos, size_type length, const char_type* s,
+		     size_type slen) const {
+    return replace(pos, length, picostring(s, slen));
+  }
+  picostring append(const picostring& s) PICOSTRING_CONST_LVALUE {
     if (s_ == NULL)
       return s;
     if (s.s_ == NULL)
       return *this;
-    return picostring(s_->append(s.s_));
+    return picostring(s_->retain()->append(s.s_));
+  }
+  picostring append(const StringT& s) PICOSTRING_CONST_LVALUE {
+    return append(s.data(), s.size());
   }
-  picostring append(const StringT& s) const {
-    if (s.empty())
+  picostring append(const char_type* s, size_type length) PICOSTRING_CONST_LVALUE {
+    if (length == 0)
       return *this;
     else if (s_ == NULL)
-      return picostring(s);
+      return picostring(s, length);
+    else
+      return picostring(s_->retain()->append(s, length));
+  }
+#if __cplusplus >= 201103L
+  // appending to a temporary hands its tree over to the result, e.g. in
+  // a.append(b).append(c)
+  picostring append(const picostring& s) && {
+    if (s.s_ == NULL)
+      return std::move(*this);
+    if (s_ == NULL)
+      return s;
+    // s may be this rope
+    const Node* tail = s.s_;
+    return picostring(_release()->append(tail));
+  }
+  picostring append(const StringT& s) && {
+    return std::move(*this).append(s.data(), s.size());
+  }
+  picostring append(const char_type* s, size_type length) && {
+    if (length == 0)
+      return std::move(*this);
+    else if (s_ == NULL)
+      return picostring(s, length);
     else
-      return picostring(s_->append(s));
+      return picostring(_release()->append(s, length));
+  }
+#endif
+  // short runs of characters prepended to a rope starting with a short leaf
+  // are merged into the leaf, as with append
+  picostring prepend(const picostring& s) const {
+    if (s.s_ != NULL && s.s_->depth() == 0 && s.size() <= SMALL_LEAF_SIZE)
+      return prepend(static_cast<const LeafNode*>(s.s_)->data(), s.size());
+    return s.append(*this);
   }
-  picostring append(const char_type* s, size_type length) const {
+  picostring prepend(const StringT& s) const {
+    return prepend(s.data(), s.size());
+  }
+  picostring prepend(const char_type* s, size_type length) const {
     if (length == 0)
       return *this;
     else if (s_ == NULL)
       return picostring(s, length);
     else
-      return picostirng(s->append(s, length));
+      return picostring(s_->retain()->prepend(s, length));
   }
+  // appends in place; if neither the rope nor its rightmost leaf is shared
+  // with others, the leaf is extended without allocating a new node
+  picostring& append_inplace(const picostring& s) {
+    if (s.s_ == NULL)
+      return *this;
+    if (s.s_->depth() == 0 && s.size() <= SMALL_LEAF_SIZE)
+      return append_inplace(static_cast<const LeafNode*>(s.s_)->data(),
+			    s.size());
+    // s may be this rope
+    const Node* tail = s.s_;
+    s_ = s_ != NULL ? _release()->append(tail) : tail->retain();
+    return *this;
+  }
+  picostring& append_inplace(const StringT& s) {
+    return append_inplace(s.data(), s.size());
+  }
+  picostring& append_inplace(const char_type* s, size_type length) {
+    if (length == 0)
+      return *this;
+    if (s_ == NULL)
+      s_ = new StringNode(s, length);
+    else if (! _extendTail(s, length))
+      s_ = _release()->append(s, length);
+    return *this;
+  }
+  picostring& operator+=(const picostring& s) { return append_inplace(s); }
+  picostring& operator+=(const StringT& s) { return append_inplace(s); }
+  picostring& operator+=(char_type c) { return append_inplace(&c, 1); }
+  // remove characters from either end; the leaves at the cut refer to the
+  // remaining part of the original ones, so nothing is copied but the path
+  // to them
+  void pop_front(size_type length) {
+    assert(length <= size());
+    *this = substr(length, size() - length);
+  }
+  void pop_back(size_type length) {
+    assert(length <= size());
+    *this = substr(0, size() - length);
+  }
+  // iterators are invalidated by any modification of the rope and by str()
+  const_iterator begin() const { return const_iterator(s_, 0); }
+  const_iterator end() const { return const_iterator(s_, size()); }
+  chunk_iterator chunk_begin() const { return chunk_iterator(s_, 0); }
+  chunk_iterator chunk_end() const { return chunk_iterator(s_, size()); }
+#ifndef _WIN32
+  // fills up to iovcnt entries of iov with the chunks starting at chunk,
+  // advancing the iterator; returns the number of entries being filled
+  size_t fill_iovec(chunk_iterator& chunk, struct iovec* iov, size_t iovcnt) const {
+    size_t i = 0;
+    for (; i != iovcnt && chunk != chunk_end(); ++i, ++chunk) {
+      iov[i].iov_base = const_cast<char_type*>(chunk->first);
+      iov[i].iov_len = chunk->second * sizeof(char_type);
+    }
+    return i;
+  }
+  // writes the rope (starting from offset) to fd without flattening it;
+  // returns the number of bytes written, which may be short if fd is
+  // non-blocking, or -1 if nothing could be written
+  ssize_t writev(int fd, size_type offset = 0) const {
+#ifdef IOV_MAX
+    enum { IOV_BATCH = IOV_MAX < 64 ? IOV_MAX : 64 };
+#else
+    enum { IOV_BATCH = 16 };
+#endif
+    assert(offset <= size());
+    chunk_iterator chunk = chunk_begin();
+    size_t skip = offset * sizeof(char_type), written = 0;
+    while (chunk != chunk_end() && skip >= chunk->second * sizeof(char_type)) {
+      skip -= chunk->second * sizeof(char_type);
+      ++chunk;
+    }
+    while (chunk != chunk_end()) {
+      struct iovec iov[IOV_BATCH];
+      chunk_iterator next = chunk;
+      size_t iovcnt = fill_iovec(next, iov, IOV_BATCH);
+      iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + skip;
+      iov[0].iov_len -= skip;
+      ssize_t ret = ::writev(fd, iov, static_cast<int>(iovcnt));
+      if (ret == -1) {
+	if (errno == EINTR)
+	  continue;
+	return written != 0 ? static_cast<ssize_t>(written) : -1;
+      }
+      written += ret;
+      skip += ret;
+      while (chunk != chunk_end() && skip >= chunk->second * sizeof(char_type)) {
+	skip -= chunk->second * sizeof(char_type);
+	++chunk;
+      }
+    }
+    return static_cast<ssize_t>(written);
+  }
+#endif
+#ifndef _WIN32
+  // maps length bytes of fd starting at offset (which need not be aligned)
+  // to out; the mapping is shared by the slices of the rope and unmapped
+  // once the last of them is gone; returns 0 if successful, or -1 with
+  // errno set
+  static int map_file(int fd, off_t offset, size_t length, picostring& out) {
+    if (length == 0) {
+      out = picostring();
+      return 0;
+    }
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    const off_t aligned = offset / pageSize * pageSize;
+    const size_t mapLength = length + (offset - aligned);
+    void* addr = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (addr == MAP_FAILED)
+      return -1;
+    Mapping* mapping = new Mapping;
+    mapping->addr = addr;
+    mapping->length = mapLength;
+    out = view(reinterpret_cast<const char_type*>(
+		 static_cast<const char*>(addr) + (offset - aligned)),
+	       length / sizeof(char_type), _unmap, mapping);
+    return 0;
+  }
+  // maps the whole file at path to out
+  static int map_file(const char* path, picostring& out) {
+    int fd;
+    while ((fd = open(path, O_RDONLY)) == -1)
+      if (errno != EINTR)
+	return -1;
+    struct stat st;
+    int ret = fstat(fd, &st) == 0 ? map_file(fd, 0, st.st_size, out) : -1;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ret;
+  }
+#endif
   const StringT& str() const {
     if (s_ == NULL) {
       static StringT emptyStr;
@@ -248,14 +1705,158 @@ public:
     }
     return _flatten()->str();
   }
+  // searches scan the rope leaf by leaf; a needle may span any number of
+  // leaves
+  size_type find(char_type c, size_type pos = 0) const {
+    if (pos >= size())
+      return npos;
+    const_iterator it(s_, pos);
+    do {
+      const char_type* p = it.leaf_->data();
+      if (const char_type* hit = StringT::traits_type::find(
+	    p + it.offset_, it.leaf_->size() - it.offset_, c))
+	return it.leafStart_ + (hit - p);
+    } while (_nextLeaf(it));
+    return npos;
+  }
+  size_type find(const picostring& s, size_type pos = 0) const {
+    const StringT& needle = s.str();
+    return find(needle.data(), pos, needle.size());
+  }
+  size_type find(const StringT& s, size_type pos = 0) const {
+    return find(s.data(), pos, s.size());
+  }
+  size_type find(const char_type* s, size_type pos, size_type length) const {
+    if (length == 0)
+      return pos <= size() ? pos : npos;
+    if (pos >= size() || length > size() - pos)
+      return npos;
+    const size_type last = size() - length;
+    const_iterator it(s_, pos);
+    do {
+      const char_type* p = it.leaf_->data();
+      const size_type end = std::min(it.leaf_->size(),
+				     last - it.leafStart_ + 1);
+      for (size_type i = it.offset_; i < end; ++i) {
+	const char_type* hit = StringT::traits_type::find(p + i, end - i, *s);
+	if (hit == NULL)
+	  break;
+	i = hit - p;
+	if (i + length <= it.leaf_->size()
+	    ? StringT::traits_type::compare(p + i, s, length) == 0
+	    : _matchesAt(it, i, s, length))
+	  return it.leafStart_ + i;
+      }
+    } while (it.leafStart_ + it.leaf_->size() <= last && _nextLeaf(it));
+    return npos;
+  }
+  size_type rfind(char_type c, size_type pos = npos) const {
+    if (s_ == NULL)
+      return npos;
+    const_iterator it(s_, std::min(pos, size() - 1));
+    for (;;) {
+      const char_type* p = it.leaf_->data();
+      if (const char_type* hit = _rfindChar(p, it.offset_ + 1, c))
+	return it.leafStart_ + (hit - p);
+      if (it.leafStart_ == 0)
+	return npos;
+      it._seek(it.leafStart_ - 1);
+    }
+  }
+  size_type rfind(const picostring& s, size_type pos = npos) const {
+    const StringT& needle = s.str();
+    return rfind(needle.data(), pos, needle.size());
+  }
+  size_type rfind(const StringT& s, size_type pos = npos) const {
+    return rfind(s.data(), pos, s.size());
+  }
+  size_type rfind(const char_type* s, size_type pos, size_type length) const {
+    if (length > size())
+      return npos;
+    pos = std::min(pos, size() - length);
+    if (length == 0)
+      return pos;
+    const_iterator it(s_, pos);
+    for (;;) {
+      const char_type* p = it.leaf_->data();
+      size_type i = it.offset_ + 1;
+      while (const char_type* hit = _rfindChar(p, i, *s)) {
+	i = hit - p;
+	if (i + length <= it.leaf_->size()
+	    ? StringT::traits_type::compare(p + i, s, length) == 0
+	    : _matchesAt(it, i, s, length))
+	  return it.leafStart_ + i;
+      }
+      if (it.leafStart_ == 0)
+	return npos;
+      it._seek(it.leafStart_ - 1);
+    }
+  }
+  size_type find_first_of(char_type c, size_type pos = 0) const {
+    return find(c, pos);
+  }
+  size_type find_first_of(const StringT& s, size_type pos = 0) const {
+    return find_first_of(s.data(), pos, s.size());
+  }
+  size_type find_first_of(const char_type* s, size_type pos,
+			  size_type length) const {
+    if (pos >= size())
+      return npos;
+    const CharSet set(s, length);
+    const_iterator it(s_, pos);
+    do {
+      const char_type* p = it.leaf_->data();
+      for (size_type i = it.offset_; i != it.leaf_->size(); ++i)
+	if (set.contains(p[i]))
+	  return it.leafStart_ + i;
+    } while (_nextLeaf(it));
+    return npos;
+  }
+#if __cplusplus >= 201103L
+  // same as str(), but the characters are copied by up to numThreads
+  // threads, each taking disjoint parts of the tree in turn; ropes shorter
+  // than PICOSTRING_PARALLEL_FLATTEN_SIZE are flattened by this thread alone
+  const StringT& str_parallel(unsigned numThreads) const {
+    if (s_ == NULL || s_->depth() == 0 || numThreads < 2
+	|| size() < static_cast<size_type>(PARALLEL_FLATTEN_SIZE))
+      return str();
+    const LinkNode* root = static_cast<const LinkNode*>(s_);
+    const StringNode* flat = ThreadingT::load(root->_flatSlot());
+    if (flat == NULL)
+      flat = _publish(root->_flatSlot(), _flattenParallel(root, numThreads));
+    if (! ThreadingT::CONCURRENT) {
+      const_cast<picostring*>(this)->s_ = flat->retain();
+      if (root->release())
+	root->destroy();
+    }
+    return flat->str();
+  }
+#endif
+  int compare(const picostring& s) const {
+    return _compare(s_, s.s_);
+  }
+  int compare(const StringT& s) const {
+    return _compare(s_, s.data(), s.size());
+  }
+  // hash of the content; ropes of equal content have equal hashes however
+  // they are built
+  size_t hash() const {
+    return s_ != NULL ? s_->hash() : 0;
+  }
+  // ropes of which the hashes are already known are told apart by them
   friend bool operator==(const picostring& x, const picostring& y) {
-    return x.size() == y.size() && x.str() == y.str();
+    if (x.size() != y.size())
+      return false;
+    if (x.s_ != NULL && x.s_->isHashed() && y.s_->isHashed()
+	&& x.s_->hash() != y.s_->hash())
+      return false;
+    return x.compare(y) == 0;
   }
   friend bool operator==(const picostring& x, const StringT& y) {
-    return x.size() == y.size() && x.str() == y;
+    return x.size() == y.size() && x.compare(y) == 0;
   }
   friend bool operator==(const StringT& x, const picostring& y) {
-    return x.size() == y.size() && x == y.str();
+    return x.size() == y.size() && y.compare(x) == 0;
   }
   friend bool operator!=(const picostring& x, const picostring& y) {
     return ! (x == y);
@@ -267,54 +1868,310 @@ public:
     return ! (x == y);
   }
   friend bool operator<(const picostring& x, const picostring& y) {
-    return x.str() < y.str();
+    return x.compare(y) < 0;
   }
   friend bool operator<(const picostring& x, const StringT& y) {
-    return x.str() < y;
+    return x.compare(y) < 0;
   }
   friend bool operator<(const StringT& x, const picostring& y) {
-    return x() < y.str();
+    return y.compare(x) > 0;
   }
   friend bool operator<=(const picostring& x, const picostring& y) {
-    return x.str() <= y.str();
+    return x.compare(y) <= 0;
   }
   friend bool operator<=(const picostring& x, const StringT& y) {
-    return x.str() <= y;
+    return x.compare(y) <= 0;
   }
   friend bool operator<=(const StringT& x, const picostring& y) {
-    return x() <= y.str();
+    return y.compare(x) >= 0;
   }
   friend bool operator>(const picostring& x, const picostring& y) {
-    return x.str() > y.str();
+    return x.compare(y) > 0;
   }
   friend bool operator>(const picostring& x, const StringT& y) {
-    return x.str() > y;
+    return x.compare(y) > 0;
   }
   friend bool operator>(const StringT& x, const picostring& y) {
-    return x() > y.str();
+    return y.compare(x) < 0;
   }
   friend bool operator>=(const picostring& x, const picostring& y) {
-    return x.str() >= y.str();
+    return x.compare(y) >= 0;
   }
   friend bool operator>=(const picostring& x, const StringT& y) {
-    return x.str() >= y;
+    return x.compare(y) >= 0;
   }
   friend bool operator>=(const StringT& x, const picostring& y) {
-    return x() >= y.str();
+    return y.compare(x) <= 0;
   }
 private:
+  bool _extendTail(const char_type* s, size_type length) {
+    const Node* node = s_;
+    for (; node->depth() != 0; node = static_cast<const LinkNode*>(node)->right())
+      if (! node->isUnique())
+	return false;
+    if (! (node->isUnique() && node->kind() == Node::STRING
+	   && static_cast<const StringNode*>(node)->isExtensible(length)))
+      return false;
+    // nobody else refers to the nodes; safe to modify them
+    for (node = s_; node->depth() != 0; node = static_cast<const LinkNode*>(node)->right())
+      const_cast<LinkNode*>(static_cast<const LinkNode*>(node))->_grow(length);
+    const_cast<StringNode*>(static_cast<const StringNode*>(node))->_extend(s, length);
+    return true;
+  }
+#ifndef _WIN32
+  struct Mapping {
+    void* addr;
+    size_t length;
+  };
+  static void _unmap(void* arg) {
+    Mapping* mapping = static_cast<Mapping*>(arg);
+    munmap(mapping->addr, mapping->length);
+    delete mapping;
+  }
+#endif
+#if __cplusplus >= 201103L
+  struct CopyTask {
+    const Node* node;
+    char_type* out;
+  };
+  // splits the tree into subtrees no longer than grain (unless they are
+  // leaves), each to be copied to its own part of the output
+  static void _splitCopy(const Node* node, char_type* out, size_type grain,
+			 std::vector<CopyTask>& tasks) {
+    while (node->depth() != 0 && node->size() > grain) {
+      const LinkNode* link = static_cast<const LinkNode*>(node);
+      _splitCopy(link->left(), out, grain, tasks);
+      out += link->left()->size();
+      node = link->right();
+    }
+    CopyTask task = { node, out };
+    tasks.push_back(task);
+  }
+  // copies the subtrees of the tasks not yet taken by other threads
+  static void _runCopy(const std::vector<CopyTask>& tasks,
+		       std::atomic<size_t>& next) {
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed))
+	   < tasks.size(); ) {
+      char_type* out = tasks[i].out;
+      LeafCursor cursor(tasks[i].node);
+      while (const LeafNode* leaf = cursor.next())
+	out = std::copy(leaf->data(), leaf->data() + leaf->size(), out);
+    }
+  }
+  // copies the content of the tree to a new leaf using up to numThreads
+  // threads, leaving the tree intact
+  static const StringNode* _flattenParallel(const Node* root,
+					    unsigned numThreads) {
+    StringNode* flat = new StringNode(root->size());
+    InstrumentationT::flattened(root->size() * sizeof(char_type));
+    std::vector<CopyTask> tasks;
+    _splitCopy(root, flat->_buffer(), root->size() / (numThreads * 8) + 1,
+	       tasks);
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads && i < tasks.size(); ++i) {
+      try {
+	threads.push_back(std::thread(_runCopy, std::cref(tasks),
+				      std::ref(next)));
+      } catch (...) {
+	// the threads already running (and this one) do the rest
+	break;
+      }
+    }
+    _runCopy(tasks, next);
+    for (size_t i = 0; i != threads.size(); ++i)
+      threads[i].join();
+    return flat;
+  }
+#endif
+  // characters held by a string or a view leaf
+  static size_t _storage(const LeafNode* leaf) {
+    if (leaf->kind() == Node::STRING)
+      return static_cast<const StringNode*>(leaf)->capacity();
+    return leaf->size();
+  }
+  // tests if the node is a slice keeping alive a string leaf more than twice
+  // its size
+  static bool _isWasteful(const Node* node) {
+    if (node->kind() != Node::SLICE)
+      return false;
+    const LeafNode* base = static_cast<const SliceNode*>(node)->base();
+    return base->kind() == Node::STRING && _storage(base) > node->size() * 2;
+  }
+  template <typename OwnerT> static void _destroyOwner(void* owner) {
+    delete static_cast<OwnerT*>(owner);
+  }
+  // gives up the reference held by the handle to the caller
+  const Node* _release() {
+    const Node* node = s_;
+    s_ = NULL;
+    return node;
+  }
+  // compares the trees chunk by chunk, skipping subtrees shared by both
+  static int _compare(const Node* x, const Node* y) {
+    if (x == y)
+      return 0;
+    LeafCursor xc(x), yc(y);
+    const char_type* xp = NULL, * yp = NULL;
+    size_type xn = 0, yn = 0;
+    for (;;) {
+      if (xn == 0 && yn == 0 && xc.peek() == yc.peek()) {
+	if (xc.peek() == NULL)
+	  return 0;
+	xc.skip();
+	yc.skip();
+	continue;
+      }
+      if (xn == 0) {
+	const LeafNode* leaf = xc.next();
+	if (leaf == NULL)
+	  return -1;
+	xp = leaf->data();
+	xn = leaf->size();
+      }
+      if (yn == 0) {
+	const LeafNode* leaf = yc.next();
+	if (leaf == NULL)
+	  return 1;
+	yp = leaf->data();
+	yn = leaf->size();
+      }
+      size_type n = std::min(xn, yn);
+      if (int r = StringT::traits_type::compare(xp, yp, n))
+	return r;
+      xp += n;
+      xn -= n;
+      yp += n;
+      yn -= n;
+    }
+  }
+  static int _compare(const Node* x, const char_type* y, size_type ylen) {
+    LeafCursor xc(x);
+    while (const LeafNode* leaf = xc.next()) {
+      size_type n = std::min(leaf->size(), ylen);
+      if (int r = StringT::traits_type::compare(leaf->data(), y, n))
+	return r;
+      if (n < leaf->size())
+	return 1;
+      y += n;
+      ylen -= n;
+    }
+    return ylen == 0 ? 0 : -1;
+  }
+  // moves the iterator to the start of the next leaf, if any
+  static bool _nextLeaf(const_iterator& it) {
+    const size_type end = it.leafStart_ + it.leaf_->size();
+    if (end == it.root_->size())
+      return false;
+    it._seek(end);
+    return true;
+  }
+  // tests if the rope contains s at the given offset within the leaf of the
+  // iterator, following the subsequent leaves as necessary; the iterator is
+  // copied only if s runs past the end of the leaf
+  static bool _matchesAt(const const_iterator& it, size_type offset,
+			 const char_type* s, size_type length) {
+    const size_type n = std::min(it.leaf_->size() - offset, length);
+    if (StringT::traits_type::compare(it.leaf_->data() + offset, s, n) != 0)
+      return false;
+    return n == length || _matchesAfter(it, s + n, length - n);
+  }
+  // tests if the leaves following that of the iterator start with s
+  static bool _matchesAfter(const_iterator it, const char_type* s,
+			    size_type length) {
+    while (_nextLeaf(it)) {
+      size_type n = std::min(it.leaf_->size(), length);
+      if (StringT::traits_type::compare(it.leaf_->data(), s, n) != 0)
+	return false;
+      if ((length -= n) == 0)
+	return true;
+      s += n;
+    }
+    return false;
+  }
+  // returns the last occurrence of c within p[0..length), scanning 16 bytes
+  // at a time if possible
+  static const char_type* _rfindChar(const char_type* p, size_type length,
+				     char_type c) {
+#ifdef PICOSTRING_USE_SSE2
+    if (sizeof(char_type) == 1) {
+      const __m128i pattern = _mm_set1_epi8(static_cast<char>(c));
+      for (; length >= 16; length -= 16) {
+	__m128i block = _mm_loadu_si128(
+	  reinterpret_cast<const __m128i*>(p + length - 16));
+	if (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)))
+	  return p + length - 16 + (31 - __builtin_clz(mask));
+      }
+    }
+#endif
+    while (length != 0)
+      if (StringT::traits_type::eq(p[--length], c))
+	return p + length;
+    return NULL;
+  }
+  // set of characters for find_first_of; looked up through a table if the
+  // characters are bytes
+  class CharSet {
+    const char_type* s_;
+    size_type length_;
+    bool table_[256];
+  public:
+    CharSet(const char_type* s, size_type length) : s_(s), length_(length) {
+      if (sizeof(char_type) == 1) {
+	std::fill(table_, table_ + 256, false);
+	for (size_type i = 0; i != length; ++i)
+	  table_[static_cast<unsigned char>(s[i])] = true;
+      }
+    }
+    bool contains(char_type c) const {
+      if (sizeof(char_type) == 1)
+	return table_[static_cast<unsigned char>(c)];
+      return StringT::traits_type::find(s_, length_, c) != NULL;
+    }
+  };
   const StringNode* _flatten() const {
     assert(s_ != NULL);
+    // other threads may be reading the tree through this handle, so the
+    // result is published to the root node instead of replacing the tree;
+    // the copy takes the place of the tree once the root is appended to
+    if (ThreadingT::CONCURRENT)
+      return s_->flattened();
     const StringNode* flat = s_->flatten();
     const_cast<picostring*>(this)->s_ = flat;
     return flat;
   }
 };
 
+template <typename StringT, typename AllocatorT, typename ThreadingT,
+	  typename InstrumentationT>
+const typename picostring<StringT, AllocatorT, ThreadingT,
+			  InstrumentationT>::size_type
+picostring<StringT, AllocatorT, ThreadingT, InstrumentationT>::npos;
+
+#if __cplusplus >= 201103L
+
+namespace std {
+  template <typename StringT, typename AllocatorT, typename ThreadingT,
+	    typename InstrumentationT>
+  struct hash<picostring<StringT, AllocatorT, ThreadingT, InstrumentationT> > {
+    typedef picostring<StringT, AllocatorT, ThreadingT, InstrumentationT>
+      argument_type;
+    size_t operator()(const argument_type& s) const {
+      return s.hash();
+    }
+  };
+}
+
+#endif
+
 #ifdef TEST_PICOSTRING
 
 #include <cstdio>
 #include <string>
+#if __cplusplus >= 201103L
+# include <thread>
+# include <unordered_set>
+#endif
 
 using namespace std;
 
@@ -344,9 +2201,22 @@ template <typename T> void is(const T& x, const T& y, const char* name = "")
 
 typedef picostring<string> picostr;
 
+static void countRelease(void* arg)
+{
+  ++*static_cast<int*>(arg);
+}
+
+struct Owner {
+  static int live;
+  Owner() { ++live; }
+  Owner(const Owner&) { ++live; }
+  ~Owner() { --live; }
+};
+int Owner::live = 0;
+
 int main(int, char**)
 {
-  plan(54);
+  plan(187);
   
   is(picostr().str(), string());
   ok(picostr().empty());
@@ -406,11 +2276,542 @@ int main(int, char**)
   ok(picostr("ac") > picostr("ab").append("c"));
   ok(picostr("ac") >= picostr("ab").append("c"));
   
+  ok(picostr("abd") > picostr("ab").append("c"));
+  ok(picostr("ab").append("c") < string("abd"));
+  ok(string("abc") == picostr("a").append("bc"));
+  ok(string("abcd") > picostr("a").append("bc"));
+  ok(picostr("a").append("bc").compare(picostr("ab").append("c")) == 0);
+  
   is(picostr("a"), picostr("ab", 1));
   is(picostr("ab"), picostr("ab", 1).append("b"));
+  is(picostr("ab", 1).append("bcd", 2), picostr("abc"));
+  is(picostr(string(200, 'a')).append("b").append("c").str(), string(200, 'a') + "bc");
   
   s = "test";
   is(s, picostr("test"));
+  s = "";
+  ok(s.empty());
+  
+  is(picostr("abef").insert(2, string("cd")).str(), string("abcdef"));
+  is(picostr("cdef").insert(0, "abc", 2).str(), string("abcdef"));
+  is(picostr("abcd").insert(4, picostr("ef")).str(), string("abcdef"));
+  is(picostr("abcxxdef").erase(3, 2).str(), string("abcdef"));
+  is(picostr("abc").erase(0, 3).str(), string());
+  is(picostr("abcxdef").replace(3, 1, string("")).str(), string("abcdef"));
+  is(picostr("axf").replace(1, 1, "bcde", 4).str(), string("abcdef"));
+  {
+    picostr doc;
+    string expected;
+    unsigned seed = 1;
+    for (int i = 0; i < 2000; ++i) {
+      seed = seed * 1103515245 + 12345;
+      size_t pos = seed % (expected.size() + 1);
+      size_t len = std::min<size_t>(seed / 7 % 50, expected.size() - pos);
+      string text(seed / 11 % 200, 'a' + i % 26);
+      switch (seed / 13 % 3) {
+      case 0:
+	doc = doc.insert(pos, text);
+	expected.insert(pos, text);
+	break;
+      case 1:
+	doc = doc.erase(pos, len);
+	expected.erase(pos, len);
+	break;
+      default:
+	doc = doc.replace(pos, len, text);
+	expected.replace(pos, len, text);
+	break;
+      }
+    }
+    ok(doc == expected, "random edits");
+  }
+  {
+    picostr built, snapshot;
+    string expected;
+    for (int i = 0; i < 10000; ++i) {
+      string frag(1 + i % 7, 'a' + i % 26);
+      if (i % 3 == 0)
+	built += frag;
+      else if (i % 3 == 1)
+	built += picostr(frag);
+      else
+	built.append_inplace(frag.data(), frag.size());
+      expected += frag;
+      if (i == 5000)
+	snapshot = built;
+    }
+    is(built.str(), expected, "append in place");
+    is(snapshot.str(), expected.substr(0, snapshot.size()), "append in place does not touch shared nodes");
+    built += 'z';
+    is(built.size(), (picostr::size_type)expected.size() + 1);
+  }
+  {
+    picostr empty, copied(empty);
+    ok(copied.empty(), "copy empty");
+    picostr x("x"), y("y");
+    swap(x, y);
+    ok(x == string("y") && y == string("x"), "swap");
+#if __cplusplus >= 201103L
+    picostr moved(std::move(x));
+    ok(x.empty() && moved == string("y"), "move");
+    x = std::move(moved);
+    ok(moved.empty() && x == string("y"), "move assignment");
+    picostr chained = picostr(string(200, 'a')).append("b").append(y).append("c", 1);
+    ok(chained == string(200, 'a') + "bxc", "append to temporary");
+    picostr twice = picostr(string(200, 'a')).append(y);
+    twice = std::move(twice).append(twice);
+    ok(twice == string(200, 'a') + "x" + string(200, 'a') + "x",
+       "append to itself through an rvalue");
+#else
+    ok(true, "# SKIP move requires C++11");
+    ok(true, "# SKIP move requires C++11");
+    ok(true, "# SKIP move requires C++11");
+    ok(true, "# SKIP move requires C++11");
+#endif
+  }
+  
+  {
+    picostr r;
+    string expected;
+    for (int i = 0; i < 100000; ++i) {
+      string c(1, 'a' + i % 26);
+      r = r.append(c);
+      expected += c;
+    }
+    is(r.at(0), 'a');
+    is(r.at(54321), expected[54321]);
+    is(r.at(99999), expected[99999]);
+    is(r.str(), expected, "long append chain");
+    for (int i = 0; i < 100000; ++i)
+      r = r.append(string(1, 'a' + i % 26));
+    expected += expected;
+    is(r.substr(99990, 20).str(), expected.substr(99990, 20), "substr across leaves");
+    is(r.substr(12345, 150000).str(), expected.substr(12345, 150000));
+    is(r.substr(12345, 150000).at(100000), expected[112345]);
+    is(r.str(), expected, "substr does not modify the source");
+    ok(r.append("x") == r.append(string("x")), "compare shared trees");
+    ok(r.substr(0, 1000).append(r.substr(1000, r.size() - 1000)) == expected);
+    ok(r.append("a") < r.append("b"));
+    
+    picostr f;
+    for (int i = 0; i < 1000; ++i)
+      f = f.append(expected.substr(i * 3, 3));
+    string scanned;
+    for (picostr::const_iterator i = f.begin(); i != f.end(); ++i)
+      scanned += *i;
+    is(scanned, expected.substr(0, 3000), "iterate forward");
+    scanned.clear();
+    for (picostr::const_iterator i = f.end(); i != f.begin(); )
+      scanned += *--i;
+    is(scanned, string(expected.rend() - 3000, expected.rend()), "iterate backward");
+    picostr::const_iterator last = f.begin();
+    std::advance(last, 3000);
+    ok(last == f.end() && *--last == expected[2999], "advance to the end");
+    scanned.clear();
+    size_t numChunks = 0;
+    bool positionsOk = true;
+    for (picostr::chunk_iterator i = f.chunk_begin(); i != f.chunk_end(); ++i, ++numChunks) {
+      positionsOk = positionsOk && i.position() == scanned.size();
+      scanned.append(i->first, i->second);
+    }
+    is(scanned, expected.substr(0, 3000), "iterate chunks");
+    ok(positionsOk, "chunk positions");
+    ok(1 < numChunks && numChunks < 100, "short appends are merged");
+    ok(picostr().begin() == picostr().end());
+    {
+      picostr doubled = f.append(f), inner = doubled.substr(1, 5998);
+      doubled = picostr();
+      ok(inner == expected.substr(1, 2999) + expected.substr(0, 2999),
+	 "destroy partially shared tree");
+    }
+    
+    FILE* fp = tmpfile();
+    is(f.writev(fileno(fp)), (ssize_t)3000, "writev");
+    is(f.writev(fileno(fp), 2990), (ssize_t)10, "writev with offset");
+    rewind(fp);
+    char buf[3011];
+    is(fread(buf, 1, sizeof(buf), fp), (size_t)3010);
+    is(string(buf, 3010), expected.substr(0, 3000) + expected.substr(2990, 10));
+    fclose(fp);
+    ok(picostr().chunk_begin() == picostr().chunk_end());
+  }
+  
+  {
+    picostr t = picostr(string(200, 'a')).append(string(200, 'b'));
+    t += t;
+    is(t.str(), string(200, 'a') + string(200, 'b') + string(200, 'a')
+       + string(200, 'b'), "append to itself");
+  }
+  is(picostr("def").prepend("abc", 3).str(), string("abcdef"));
+  is(picostr("ef").prepend(string("cd")).prepend(picostr("ab")).str(),
+     string("abcdef"));
+  {
+    string expected(1000, 'x');
+    expected += "yz";
+    picostr t(expected);
+    t.pop_front(1);
+    t.pop_back(1);
+    is(t.str(), expected.substr(1, 1000), "pop from a leaf");
+    picostr d;
+    expected.clear();
+    bool dequeOk = true;
+    for (int i = 0; i < 20000; ++i) {
+      string text(i % 7 == 0 ? 300 : i % 5, 'a' + i % 26);
+      switch (i % 4) {
+      case 0:
+	d = d.prepend(text);
+	expected.insert(0, text);
+	break;
+      case 1:
+	d += text;
+	expected += text;
+	break;
+      case 2:
+	d.pop_front(min(expected.size(), (size_t)i % 11));
+	expected.erase(0, min(expected.size(), (size_t)i % 11));
+	break;
+      default:
+	d.pop_back(min(expected.size(), (size_t)i % 3));
+	expected.erase(expected.size() - min(expected.size(), (size_t)i % 3));
+	break;
+      }
+      dequeOk = dequeOk && d.size() == expected.size()
+	&& (i % 1000 != 0 || d == expected);
+    }
+    ok(dequeOk && d == expected, "push and pop at both ends");
+  }
+  
+  {
+    picostr t = picostr("abc").append("de").append(string(200, 'f'))
+      .append("ghabc");
+    is(t.find('d'), (picostr::size_type)3);
+    is(t.find('g', 4), (picostr::size_type)205);
+    is(t.find('x'), picostr::npos);
+    is(t.find("cdef"), (picostr::size_type)2, "find across leaves");
+    is(t.find(string("abc"), 1), (picostr::size_type)207);
+    is(t.find(picostr("fgh")), (picostr::size_type)204);
+    is(t.find("abcd", 1), picostr::npos);
+    is(t.rfind('a'), (picostr::size_type)207);
+    is(t.rfind('a', 206), (picostr::size_type)0);
+    is(t.rfind("bcd"), (picostr::size_type)1, "rfind across leaves");
+    is(t.rfind(string("")), t.size());
+    is(t.find_first_of(string("hg"), 3), (picostr::size_type)205);
+    is(t.find_first_of("xyz", 0, 3), picostr::npos);
+    string expected;
+    picostr r;
+    for (int i = 0; i < 3000; ++i) {
+      string piece(1 + i % 9, "abcab"[i % 5]);
+      expected += piece;
+      r = r.append(piece);
+    }
+    bool searchOk = true;
+    for (size_t pos = 0; pos < expected.size(); pos += 97) {
+      string needle = expected.substr(pos * 7 % expected.size(), 1 + pos % 13);
+      searchOk = searchOk && r.find(needle, pos) == expected.find(needle, pos)
+	&& r.rfind(needle, pos) == expected.rfind(needle, pos)
+	&& r.find(needle[0], pos) == expected.find(needle[0], pos)
+	&& r.rfind(needle[0], pos) == expected.rfind(needle[0], pos)
+	&& r.find_first_of("bc", pos) == expected.find_first_of("bc", pos);
+    }
+    ok(searchOk, "search as std::string");
+  }
+  
+  {
+    picostr x = picostr("ab").append(string(300, 'c')).append("de");
+    picostr y = picostr(string("abc")).append(string(299, 'c') + "d")
+      .append("e");
+    is(x.hash(), y.hash(), "hash does not depend on the shape");
+    is(x.hash(), picostr(x.str()).hash());
+    is(x.substr(1, 300).hash(), y.substr(1, 300).hash());
+    ok(x.hash() != x.substr(1, 302).prepend("b", 1).hash());
+    picostr z = x.substr(0, 302).append("dd");
+    z.hash();
+    ok(x != z, "unequal hashes");
+    ok(x == y);
+    picostr w = picostr(string(200, 'a')).append(string(200, 'b'));
+    w.hash();
+    w += "f";
+    is(w.hash(), picostr(string(200, 'a') + string(200, 'b') + "f").hash(),
+       "hash after growing in place");
+    picostr nul = picostr(string(1000, '\0')).append(string(1000, '\0'));
+    nul.hash();
+    nul += "g";
+    is(nul.hash(), picostr(string(2000, '\0') + "g").hash(),
+       "hash a run of NUL characters");
+#if __cplusplus >= 201103L
+    unordered_set<picostr> set;
+    set.insert(x);
+    set.insert(y);
+    set.insert(z);
+    is(set.size(), (size_t)2, "std::hash");
+#else
+    ok(true, "# SKIP std::hash requires C++11");
+#endif
+  }
+  
+  {
+    picostr a = picostr(string(200, 'a')).append(string(200, 'b'));
+    picostr b = a, c = a;
+    is(a.str(), string(200, 'a') + string(200, 'b'));
+    ok(b.str().data() == a.str().data(), "flatten a shared tree once");
+    ok(c.str().data() == a.str().data());
+    picostr d = picostr("x").append(a.substr(100, 200)).append("y");
+    picostr e = d;
+    is(d.str(), "x" + string(100, 'a') + string(100, 'b') + "y");
+    ok(e.str().data() == d.str().data());
+    picostr doc = picostr(string(3000, 'a')).append(string(3000, 'b'));
+    picostr snap = doc;
+    doc.str();
+    doc = picostr();
+    snap = snap.append(string(200, 'c'));
+    ok(snap.stats().storage < snap.size() * 3 / 2,
+       "free the tree of a memoized copy");
+  }
+  
+  {
+    static const char buf[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    string large(1000, 'v');
+    int released = 0;
+    {
+      picostr v = picostr::view(buf, 36, countRelease, &released);
+      is(v.at(10), 'a', "view");
+      picostr t = picostr("<").append(v).append(">");
+      v = picostr();
+      is(t.str(), string("<") + buf + ">");
+      picostr l = picostr::view(large.data(), large.size(), countRelease,
+				&released);
+      picostr m = l.substr(100, 500);
+      l = picostr();
+      is(released, 1, "slices keep the view alive");
+      is(m.find('v', 200), (picostr::size_type)200);
+      is(m.substr(1, 498).str(), string(498, 'v'));
+    }
+    is(released, 2, "views are released once");
+    {
+      Owner owner;
+      picostr o = picostr::view(large.data(), large.size(), owner);
+      is(Owner::live, 2);
+    }
+    is(Owner::live, 0, "view with an owner");
+  }
+  
+  {
+    string expected;
+    for (int i = 0; i < 10000; ++i)
+      expected += 'a' + i % 26;
+    FILE* fp = tmpfile();
+    fwrite(expected.data(), 1, expected.size(), fp);
+    fflush(fp);
+    picostr m;
+    is(picostr::map_file(fileno(fp), 0, 10000, m), 0, "map_file");
+    ok(m == expected);
+    picostr part;
+    is(picostr::map_file(fileno(fp), 5000, 3000, part), 0);
+    fclose(fp);
+    m = m.substr(100, 200).append(part.substr(1000, 1000));
+    part = picostr();
+    is(m.str(), expected.substr(100, 200) + expected.substr(6000, 1000),
+       "slices of mappings");
+    errno = 0;
+    ok(picostr::map_file("/nonexistent/picostring", m) == -1 && errno == ENOENT);
+  }
+  
+  {
+#if __cplusplus >= 201103L
+    string expected;
+    picostr p;
+    for (int i = 0; i < 300000; ++i) {
+      string piece(1 + i % 13, 'a' + i % 26);
+      expected += piece;
+      p = p.append(piece);
+    }
+    picostr q = p;
+    ok(p.str_parallel(4) == expected, "parallel flatten");
+    ok(q.str().data() == p.str().data());
+#else
+    ok(true, "# SKIP parallel flatten requires C++11");
+    ok(true, "# SKIP parallel flatten requires C++11");
+#endif
+  }
+  
+  {
+    picostr t = picostr(string(1000, 'a')).append(string(1000, 'b'));
+    picostr::stats_type st = t.stats();
+    is(st.depth, (size_t)1, "stats");
+    is(st.num_links + st.num_strings + st.num_slices + st.num_views,
+       (size_t)3);
+    is(st.max_leaf, (picostr::size_type)1000);
+    picostr u = t.substr(500, 1000);
+    st = u.stats();
+    is(st.num_slices, (size_t)2);
+    ok(st.storage >= 2000 && st.num_shared == 0);
+    picostr v = u, w = u;
+    v.str();
+    st = u.stats();
+    ok(st.num_shared == 1 && st.num_memoized == 1 && st.storage >= 3000);
+    is(picostr().stats().num_strings, (size_t)0);
+  }
+  
+  {
+    picostr t(string(100000, 'a'));
+    picostr u = t.substr(10, 1000).append(t.substr(20000, 2000));
+    t = picostr();
+    ok(u.stats().storage >= 200000);
+    u.compact();
+    ok(u.stats().storage < 6000, "compact slices");
+    is(u.str(), string(3000, 'a'));
+    picostr x = picostr(string(100000, 'b')).substr(10, 1000)
+      .append(picostr(string(100000, 'c')).substr(10, 1000));
+    picostr y = x;
+    x.compact();
+    ok(x.stats().num_slices == 2 && x.stats().num_shared == 1,
+       "compact keeps shared ropes");
+    picostr base(string(100000, 'd'));
+    picostr slice = base.substr(10, 10000);
+    base = picostr();
+    picostr z = slice.append(string(10000, 'e'));
+    z.compact();
+    ok(z.stats().num_slices == 1, "compact keeps shared slices");
+    string external(100000, 'v');
+    picostr v = picostr::view(external.data(), external.size());
+    picostr w = v.substr(10, 10000).append(v.substr(50000, 20000));
+    v = picostr();
+    w.compact();
+    ok(w.stats().num_slices == 2 && w.stats().num_strings == 0,
+       "compact keeps slices of views");
+    string expected;
+    picostr r;
+    for (int i = 0; i < 100; ++i) {
+      string piece(100, 'a' + i % 26);
+      r = r.append(piece);
+      expected += piece;
+    }
+    r.compact();
+    ok(r.stats().num_strings <= 3, "compact short leaves");
+    ok(r == expected);
+  }
+  
+  {
+    typedef picostring<string, picostring_heap_allocator,
+		       picostring_single_threaded,
+		       picostring_counting_instrumentation> counted;
+    picostring_counters& c = picostring_counting_instrumentation::counters();
+    c = picostring_counters();
+    {
+      counted t = counted(string(200, 'a')).append(string(200, 'b'));
+      is(c.nodes_allocated, (size_t)3, "count allocations");
+      is(t.at(300), 'b');
+      is(c.descent_steps, (size_t)1);
+      t.str();
+      is(c.flattens, (size_t)1, "count flattens");
+      is(c.bytes_flattened, (size_t)400);
+    }
+    is(c.nodes_freed, c.nodes_allocated);
+  }
+  
+  {
+    picostr::builder b;
+    b.reserve(3);
+    b.append("ab", 2).append(string("cd")).append(picostr("ef"));
+    is(b.size(), (picostr::size_type)6);
+    is(b.build().str(), string("abcdef"), "builder");
+    is(b.size(), (picostr::size_type)0);
+    string expected;
+    picostr big(string(1000, 'x'));
+    for (int i = 0; i < 5000; ++i) {
+      string piece(i % 17, 'a' + i % 26);
+      b.append(piece);
+      expected += piece;
+      if (i % 10 == 0) {
+	b.append(big.substr(i % 500, 300));
+	expected += string(300, 'x');
+      }
+    }
+    picostr built = b.build();
+    ok(built == expected, "build a balanced tree");
+    is(built.at(30000), expected[30000]);
+    b.append(picostr(string(200, 'y')));
+    b.append("z", 1);
+    b.clear();
+    ok(b.build().empty());
+  }
+  
+  {
+    typedef picostring<string, picostring_pool_allocator> pooled;
+    pooled p;
+    for (int i = 0; i < 1000; ++i)
+      p = p.append(string(1, 'a' + i % 26));
+    is(p.size(), (pooled::size_type)1000, "pool allocator");
+    is(p.substr(26, 3).str(), string("abc"));
+#if __cplusplus >= 201103L
+    void* freed = NULL;
+    void* reused = NULL;
+    std::thread([&freed]() {
+	freed = picostring_pool_allocator::allocate(48);
+	picostring_pool_allocator::deallocate(freed, 48);
+      }).join();
+    std::thread([&reused]() {
+	reused = picostring_pool_allocator::allocate(48);
+	picostring_pool_allocator::deallocate(reused, 48);
+      }).join();
+    ok(reused == freed, "pool reuses the blocks of exited threads");
+#else
+    ok(true, "# SKIP threads require C++11");
+#endif
+  }
+  {
+    typedef picostring<string, picostring_arena_allocator> arenaed;
+    picostring_arena arena;
+    arenaed p;
+    for (int i = 0; i < 1000; ++i)
+      p = p.append(string(1, 'a' + i % 26));
+    is(p.size(), (arenaed::size_type)1000, "arena allocator");
+    is(p.substr(26, 3).str(), string("abc"));
+  }
+  
+  {
+#if __cplusplus >= 201103L
+    typedef picostring<string, picostring_heap_allocator,
+		       picostring_multi_threaded> shared;
+    shared p;
+    string expected;
+    for (int i = 0; i < 10000; ++i) {
+      p = p.append(string(1, 'a' + i % 26));
+      expected += 'a' + i % 26;
+    }
+    bool threadsOk[4];
+    std::thread threads[4];
+    for (int i = 0; i < 4; ++i)
+      threads[i] = std::thread([&p, &expected, &threadsOk, i]() {
+	  bool good = true;
+	  for (int j = 0; j < 100; ++j) {
+	    shared copy = p;
+	    shared longer = copy.append("x");
+	    good = good && longer.substr(0, copy.size()) == p;
+	    good = good && p.str() == expected;
+	  }
+	  threadsOk[i] = good;
+	});
+    for (int i = 0; i < 4; ++i)
+      threads[i].join();
+    ok(threadsOk[0] && threadsOk[1] && threadsOk[2] && threadsOk[3],
+       "share across threads");
+    shared q(expected);
+    q.pop_front(10);
+    ok(q.str() == expected.substr(10), "flatten a slice");
+    shared r;
+    for (int i = 0; i < 100; ++i) {
+      r = r.append(string(1000, 'a' + i % 26));
+      r.str();
+    }
+    ok(r.stats().storage <= r.size() * 2,
+       "copies memoized by str() do not pile up");
+#else
+    ok(true, "# SKIP threads require C++11");
+    ok(true, "# SKIP threads require C++11");
+    ok(true, "# SKIP threads require C++11");
+#endif
+  }
   
   return 0;
 }
@@ -0,0 +1,374 @@
+/*
+ * Copyright 2012 Kazuho Oku
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the author.
+ *
+ */
+
+/*
+ * Benchmarks picostring against std::string and std::ostringstream.
+ *
+ * build: c++ -O2 -o picostring_bench picostring_bench.cc
+ * usage: picostring_bench [fragment_size [num_fragments]]
+ *
+ * Without arguments, runs a matrix of fragment sizes and rope lengths.  Each
+ * bench of each case runs in a forked process so that its own peak RSS can
+ * be reported.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "picostring.h"
+
+using namespace std;
+
+static size_t numAllocs = 0;
+
+void* operator new(size_t size)
+{
+  ++numAllocs;
+  if (void* p = malloc(size != 0 ? size : 1))
+    return p;
+  throw bad_alloc();
+}
+
+void operator delete(void* p) throw()
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+  free(p);
+}
+
+typedef picostring<string> picostr;
+typedef picostring<string, picostring_pool_allocator> pooledstr;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static size_t fragSize, numFrags;
+static const char* benchName;
+static const char* implName;
+static double startAt;
+static size_t startAllocs;
+static volatile size_t sink;
+
+static void start(const char* bench, const char* impl)
+{
+  benchName = bench;
+  implName = impl;
+  startAllocs = numAllocs;
+  startAt = now();
+}
+
+// excludes the setup of the next iteration from the measurement
+static double pausedAt;
+static size_t pausedAllocs;
+
+static void pauseTimer()
+{
+  pausedAt = now();
+  pausedAllocs = numAllocs;
+}
+
+static void resumeTimer()
+{
+  startAt += now() - pausedAt;
+  startAllocs += numAllocs - pausedAllocs;
+}
+
+static void stop(size_t ops)
+{
+  double elapsed = now() - startAt;
+  size_t allocs = numAllocs - startAllocs;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-10s %-14s %6zu %8zu %12.1f %10.2f %10ld\n", benchName, implName,
+	 fragSize, numFrags, elapsed * 1e9 / ops, (double)allocs / ops,
+	 ru.ru_maxrss);
+  fflush(stdout);
+}
+
+static string fragment(size_t i)
+{
+  return string(fragSize, 'a' + i % 26);
+}
+
+template <typename RopeT> static RopeT buildRope()
+{
+  RopeT s;
+  for (size_t i = 0; i != numFrags; ++i)
+    s = s.append(fragment(i));
+  return s;
+}
+
+static string buildString()
+{
+  string s;
+  for (size_t i = 0; i != numFrags; ++i)
+    s += fragment(i);
+  return s;
+}
+
+static const size_t numAccesses = 1000000;
+
+template <typename RopeT> static void benchAppend(const char* impl)
+{
+  start("append", impl);
+  RopeT s = buildRope<RopeT>();
+  sink = s.size();
+  stop(numFrags);
+}
+
+template <typename RopeT> static void benchAppendInPlace(const char* impl)
+{
+  start("append+=", impl);
+  RopeT s;
+  for (size_t i = 0; i != numFrags; ++i)
+    s += fragment(i);
+  sink = s.size();
+  stop(numFrags);
+}
+
+template <typename RopeT> static void benchBuilder(const char* impl)
+{
+  start("builder", impl);
+  typename RopeT::builder b;
+  b.reserve(numFrags);
+  for (size_t i = 0; i != numFrags; ++i)
+    b.append(fragment(i));
+  RopeT s = b.build();
+  sink = s.size();
+  stop(numFrags);
+}
+
+template <typename RopeT> static void benchAt(const char* impl)
+{
+  const size_t len = fragSize * numFrags;
+  RopeT s = buildRope<RopeT>();
+  start("at", impl);
+  for (size_t i = 0; i != numAccesses; ++i)
+    sink += s.at(i * 7919 % len);
+  stop(numAccesses);
+}
+
+template <typename RopeT> static void benchSubstr(const char* impl)
+{
+  const size_t len = fragSize * numFrags;
+  RopeT s = buildRope<RopeT>();
+  start("substr", impl);
+  for (size_t i = 0; i != 10000; ++i)
+    sink += s.substr(i * 7919 % (len / 2), len / 2).size();
+  stop(10000);
+}
+
+template <typename RopeT> static void benchCompare(const char* impl)
+{
+  RopeT s = buildRope<RopeT>(), t = buildRope<RopeT>();
+  start("compare", impl);
+  for (size_t i = 0; i != 10; ++i)
+    sink += s == t;
+  stop(10);
+}
+
+template <typename RopeT> static void benchFlatten(const char* impl)
+{
+  start("flatten", impl);
+  for (size_t i = 0; i != 10; ++i) {
+    pauseTimer();
+    RopeT copy = buildRope<RopeT>();
+    resumeTimer();
+    sink += copy.str().size();
+  }
+  stop(10);
+}
+
+template <typename RopeT> static void benchCopy(const char* impl)
+{
+  RopeT s = buildRope<RopeT>();
+  start("copy", impl);
+  for (size_t i = 0; i != 1000; ++i) {
+    RopeT copy = s;
+    sink += copy.size();
+  }
+  stop(1000);
+}
+
+template <typename RopeT> static void benchDestroy(const char* impl)
+{
+  start("destroy", impl);
+  for (size_t i = 0; i != 10; ++i) {
+    pauseTimer();
+    RopeT u = buildRope<RopeT>();
+    resumeTimer();
+    u = RopeT();
+  }
+  stop(10);
+}
+
+static void benchStreamAppend(const char* impl)
+{
+  start("append", impl);
+  ostringstream os;
+  for (size_t i = 0; i != numFrags; ++i)
+    os << fragment(i);
+  sink = os.str().size();
+  stop(numFrags);
+}
+
+static void benchStringAppend(const char* impl)
+{
+  start("append", impl);
+  string s = buildString();
+  sink = s.size();
+  stop(numFrags);
+}
+
+static void benchStringAt(const char* impl)
+{
+  const size_t len = fragSize * numFrags;
+  string s = buildString();
+  start("at", impl);
+  for (size_t i = 0; i != numAccesses; ++i)
+    sink += s[i * 7919 % len];
+  stop(numAccesses);
+}
+
+static void benchStringSubstr(const char* impl)
+{
+  const size_t len = fragSize * numFrags;
+  string s = buildString();
+  start("substr", impl);
+  for (size_t i = 0; i != 10000; ++i)
+    sink += s.substr(i * 7919 % (len / 2), len / 2).size();
+  stop(10000);
+}
+
+static void benchStringCompare(const char* impl)
+{
+  string s = buildString(), t = buildString();
+  start("compare", impl);
+  for (size_t i = 0; i != 10; ++i)
+    sink += s == t;
+  stop(10);
+}
+
+static void benchStringCopy(const char* impl)
+{
+  string s = buildString();
+  start("copy", impl);
+  for (size_t i = 0; i != 1000; ++i) {
+    string copy = s;
+    sink += copy.size();
+  }
+  stop(1000);
+}
+
+static void benchStringDestroy(const char* impl)
+{
+  start("destroy", impl);
+  for (size_t i = 0; i != 10; ++i) {
+    pauseTimer();
+    string u = buildString();
+    resumeTimer();
+    string().swap(u);
+  }
+  stop(10);
+}
+
+// runs each bench in a process of its own, so that the peak RSS reported is
+// that of the bench alone
+static void runForked(void (*bench)(const char*), const char* impl)
+{
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  } else if (pid == 0) {
+    bench(impl);
+    exit(0);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) == -1)
+    ;
+}
+
+template <typename RopeT> static void runRope(const char* impl)
+{
+  runForked(benchAppend<RopeT>, impl);
+  runForked(benchAppendInPlace<RopeT>, impl);
+  runForked(benchBuilder<RopeT>, impl);
+  runForked(benchAt<RopeT>, impl);
+  runForked(benchSubstr<RopeT>, impl);
+  runForked(benchCompare<RopeT>, impl);
+  runForked(benchFlatten<RopeT>, impl);
+  runForked(benchCopy<RopeT>, impl);
+  runForked(benchDestroy<RopeT>, impl);
+}
+
+static void runCase(size_t frag, size_t num)
+{
+  fragSize = frag;
+  numFrags = num;
+  runForked(benchStringAppend, "std::string");
+  runForked(benchStreamAppend, "ostringstream");
+  runForked(benchStringAt, "std::string");
+  runForked(benchStringSubstr, "std::string");
+  runForked(benchStringCompare, "std::string");
+  runForked(benchStringCopy, "std::string");
+  runForked(benchStringDestroy, "std::string");
+  runRope<picostr>("picostring");
+  runRope<pooledstr>("picostring/pool");
+}
+
+int main(int argc, char** argv)
+{
+  printf("%-10s %-14s %6s %8s %12s %10s %10s\n", "bench", "impl", "frag",
+	 "count", "ns/op", "allocs/op", "maxrss(KB)");
+  fflush(stdout);
+  if (argc > 1) {
+    runCase(atol(argv[1]), argc > 2 ? atol(argv[2]) : 100000);
+  } else {
+    static const size_t frags[] = { 4, 64, 1024 };
+    static const size_t nums[] = { 1000, 100000 };
+    for (size_t i = 0; i != sizeof(frags) / sizeof(frags[0]); ++i)
+      for (size_t j = 0; j != sizeof(nums) / sizeof(nums[0]); ++j)
+	runCase(frags[i], nums[j]);
+  }
+  return 0;
+}
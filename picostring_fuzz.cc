@@ -0,0 +1,256 @@
+/*
+ * Copyright 2012 Kazuho Oku
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of the author.
+ *
+ */
+
+/*
+ * Applies random sequences of operations to a few picostrings and to
+ * std::strings mirroring them, and checks that they agree.
+ *
+ * build: c++ -g -O1 -fsanitize=address,undefined -o picostring_fuzz \
+ *            picostring_fuzz.cc
+ * usage: picostring_fuzz [iterations [seed]]
+ *
+ * libFuzzer: clang++ -g -O1 -fsanitize=fuzzer,address,undefined \
+ *            -DPICOSTRING_LIBFUZZER -o picostring_fuzz picostring_fuzz.cc
+ *
+ * The leaves are made tiny so that short inputs already build deep trees.
+ */
+
+#define PICOSTRING_SMALL_LEAF_SIZE 4
+#define PICOSTRING_TAIL_LEAF_SIZE 16
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "picostring.h"
+
+using namespace std;
+
+typedef picostring<string> picostr;
+
+enum { NUM_SLOTS = 4, MAX_LENGTH = 4096 };
+
+static void fail(const char* what, int line)
+{
+  fprintf(stderr, "mismatch at line %d: %s\n", line, what);
+  abort();
+}
+
+#define CHECK(cond) do { if (! (cond)) fail(#cond, __LINE__); } while (0)
+
+// reads the input as a sequence of small integers
+class Input {
+  const unsigned char* p_;
+  size_t left_;
+public:
+  Input(const unsigned char* p, size_t len) : p_(p), left_(len) {}
+  bool empty() const { return left_ == 0; }
+  // reads as many bytes as needed to cover [0, bound)
+  size_t next(size_t bound) {
+    size_t v = 0;
+    for (size_t range = 1; range < bound && left_ != 0; range <<= 8) {
+      v = v << 8 | *p_++;
+      --left_;
+    }
+    return bound != 0 ? v % bound : 0;
+  }
+  string text() {
+    size_t len = next(40);
+    char c = static_cast<char>('a' + next(4));
+    string s;
+    for (size_t i = 0; i != len; ++i)
+      s += static_cast<char>(c + i % 3);
+    return s;
+  }
+};
+
+static void check(const picostr& r, const string& s)
+{
+  CHECK(r.size() == s.size());
+  CHECK(r.empty() == s.empty());
+  CHECK(r == s);
+  CHECK(s == r);
+  size_t n = 0;
+  for (picostr::chunk_iterator c = r.chunk_begin(); c != r.chunk_end(); ++c) {
+    CHECK(c.position() == n);
+    CHECK(string(c->first, c->second) == s.substr(n, c->second));
+    n += c->second;
+  }
+  CHECK(n == s.size());
+  if (! s.empty()) {
+    CHECK(r.at(0) == s[0]);
+    CHECK(r.at(s.size() / 2) == s[s.size() / 2]);
+    CHECK(*--r.end() == s[s.size() - 1]);
+  }
+}
+
+static void run(Input& in)
+{
+  picostr ropes[NUM_SLOTS];
+  string strs[NUM_SLOTS];
+  while (! in.empty()) {
+    size_t x = in.next(NUM_SLOTS), y = in.next(NUM_SLOTS);
+    picostr& r = ropes[x];
+    string& s = strs[x];
+    size_t pos = in.next(s.size() + 1), len = in.next(s.size() - pos + 1);
+    switch (in.next(20)) {
+    case 0: {
+      string t = in.text();
+      r = r.append(t);
+      s += t;
+    } break;
+    case 1:
+      r = r.append(ropes[y]);
+      s += strs[y];
+      break;
+    case 2: {
+      string t = in.text();
+      r += t;
+      s += t;
+    } break;
+    case 3:
+      r += ropes[y];
+      s += strs[y];
+      break;
+    case 4: {
+      string t = in.text();
+      r = r.prepend(t);
+      s.insert(0, t);
+    } break;
+    case 5:
+      r = r.substr(pos, len);
+      s = s.substr(pos, len);
+      break;
+    case 6:
+      r = r.insert(pos, ropes[y]);
+      s.insert(pos, strs[y]);
+      break;
+    case 7:
+      r = r.erase(pos, len);
+      s.erase(pos, len);
+      break;
+    case 8: {
+      string t = in.text();
+      r = r.replace(pos, len, t);
+      s.replace(pos, len, t);
+    } break;
+    case 9:
+      r.pop_front(len);
+      s.erase(0, len);
+      break;
+    case 10:
+      r.pop_back(len);
+      s.erase(s.size() - len);
+      break;
+    case 11:
+      ropes[y] = r;
+      strs[y] = s;
+      break;
+    case 12:
+      CHECK((r < ropes[y]) == (s < strs[y]));
+      CHECK((r == ropes[y]) == (s == strs[y]));
+      CHECK((r.hash() == ropes[y].hash()) || s != strs[y]);
+      break;
+    case 13:
+      CHECK(r.str() == s);
+      break;
+    case 14: {
+      string t = in.text();
+      CHECK(r.find(t, pos) == s.find(t, pos));
+      CHECK(r.rfind(t, pos) == s.rfind(t, pos));
+      if (! t.empty()) {
+	CHECK(r.find(t[0], pos) == s.find(t[0], pos));
+	CHECK(r.rfind(t[0], pos) == s.rfind(t[0], pos));
+	CHECK(r.find_first_of(t, pos) == s.find_first_of(t, pos));
+      }
+    } break;
+    case 15: {
+      string t1 = in.text(), t2 = in.text();
+      picostr::builder b;
+      b.append(r).append(t1).append(ropes[y]).append(t2.data(), t2.size());
+      r = b.build();
+      s = s + t1 + strs[y] + t2;
+    } break;
+    case 16:
+      r.compact();
+      break;
+    case 17: {
+      static const string external(256, 'v');
+      len %= external.size();
+      r = r.append(picostr::view(external.data(), len));
+      s += external.substr(0, len);
+    } break;
+    case 18: {
+      picostr::const_iterator it = r.begin();
+      for (size_t i = 0; i != s.size(); ++i, ++it)
+	CHECK(*it == s[i]);
+      CHECK(it == r.end());
+    } break;
+    default:
+      r = picostr();
+      s.clear();
+      break;
+    }
+    // keeps repeated self-appends from growing exponentially
+    if (s.size() > MAX_LENGTH) {
+      r.pop_back(s.size() - MAX_LENGTH);
+      s.resize(MAX_LENGTH);
+    }
+    check(r, s);
+  }
+  for (size_t i = 0; i != NUM_SLOTS; ++i)
+    check(ropes[i], strs[i]);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const unsigned char* data, size_t size)
+{
+  Input in(data, size);
+  run(in);
+  return 0;
+}
+
+#ifndef PICOSTRING_LIBFUZZER
+
+int main(int argc, char** argv)
+{
+  long iterations = argc > 1 ? atol(argv[1]) : 10000;
+  unsigned seed = argc > 2 ? static_cast<unsigned>(atol(argv[2])) : 1;
+  srand(seed);
+  vector<unsigned char> buf;
+  for (long i = 0; i != iterations; ++i) {
+    buf.resize(rand() % 4096);
+    for (size_t j = 0; j != buf.size(); ++j)
+      buf[j] = static_cast<unsigned char>(rand());
+    LLVMFuzzerTestOneInput(buf.empty() ? NULL : &buf[0], buf.size());
+  }
+  printf("%ld iterations ok\n", iterations);
+  return 0;
+}
+
+#endif